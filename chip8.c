@@ -6,11 +6,32 @@
 #include <SDL2/SDL.h>
 #include <time.h>
 #include <curses.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <stddef.h>
+#include "chip8_env.h"
 
 /* INTERPRETER DATA*/
 
-// game speed
-uint32_t speed = 5;
+// game speed in instructions executed per frame
+const uint32_t DEFAULT_IPF = 10;
+uint32_t ipf = 10;
+
+// the display and timers are updated at 60 frames per second
+const uint32_t FRAME_MS = 1000 / 60;
+
+// in turbo mode frames run back to back as fast as possible
+// and only one frame is presented per display refresh
+uint8_t turbo = 0x0;
 
 // screen width is 64 pixels
 const int SCREEN_WIDTH = 64;
@@ -19,6 +40,9 @@ const int SCREEN_HEIGHT = 32;
 // chip-8 programs start at memory address 0x200
 const uint32_t PROGSTART = 0x200;
 
+// the largest rom that fits between PROGSTART and the end of memory
+const uint32_t ROM_MAX = 0x1000 - 0x200;
+
 // the font set is stored starting at 0x50
 const uint32_t FONTSTART = 0x50;
 
@@ -29,10 +53,36 @@ uint8_t registers[0x10] = {0};
 // 1 if key pressed else 0
 uint8_t user_keypad[16] = {0};
 
+// everything that makes up one running machine, the registers are swapped in
+// and out of the globals to run it while its memory and display are used in place
+struct machine
+{
+    uint8_t registers[0x10];
+    uint8_t user_keypad[16];
+    uint8_t main_mem[0x1000];
+    uint16_t index_register;
+    uint16_t stack[0x10];
+    uint16_t stack_pointer;
+    uint16_t program_counter;
+    uint16_t opcode;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t idle;
+    int32_t vip_clock;
+    uint32_t rng_state;
+    uint32_t video[64 * 32];
+};
+
+// the machine run from the command line
+struct machine console;
+
 // chip-8 has 4096 bytes of memory
 // which translate to addresses ranging
-// from 0x000 to 0xFFF
-uint8_t main_mem[0xFFF] = {0};
+// from 0x000 to 0xFFF, every address is masked
+// to 12 bits so no rom can reach past them. This points at the memory
+// of the machine being run so the environment api
+// can run each of its machines in place
+uint8_t *main_mem = console.main_mem;
 
 // chip-8 has a 16 bit index register
 // which is used to store memory addresses for use in operations
@@ -54,7 +104,8 @@ uint16_t program_counter = PROGSTART;
 // chip-8 has a 64x32 monochrome display
 // where each pixel is either on or off
 // pixels overlapping eachother are xor'd
-uint32_t video[64 * 32];
+// display of the machine being run
+uint32_t *video = console.video;
 
 // there are sixteen opcodes so we can
 // switch on an integer for witch one to call
@@ -63,9 +114,45 @@ uint16_t opcode = 0x0;
 uint8_t delay_timer = 0x0;
 uint8_t sound_timer = 0x0;
 
+// Cxkk draws from a xorshift generator kept with the machine so that
+// restoring a saved machine replays the same random numbers
+const uint32_t RNG_SEED = 0x2545F491u;
+uint32_t rng_state = RNG_SEED;
+
 // boolean to determine if system should be paused
 uint8_t prog_pause = 0x0;
 
+// chip-8 implementations disagree on a few instructions
+// the quirks set here select the behaviour a rom expects
+const uint8_t QUIRK_SHIFT = 0x1;     // 8xy6 and 8xyE shift Vy into Vx
+const uint8_t QUIRK_LOADSTORE = 0x2; // Fx55 and Fx65 leave I past the last register
+const uint8_t QUIRK_JUMP = 0x4;      // Bnnn jumps to xnn + Vx
+const uint8_t QUIRK_VIP = 0x8;       // instructions take as long as on the COSMAC VIP and Dxyn waits for vblank
+
+uint8_t quirks = 0x0;
+
+// quirks given on the command line, added to every rom's own
+uint8_t forced_quirks = 0x0;
+
+// with vip timing, the machine cycles left in the current frame,
+// negative when the last instruction ran on into the next one
+int32_t vip_clock = 0;
+
+// set when the rom is spinning in a loop that cannot make any progress
+// before the next timer tick or key press, so the rest of the frame can be skipped
+const uint8_t IDLE_NONE = 0x0;
+const uint8_t IDLE_JUMP = 0x1;  // jump to itself
+const uint8_t IDLE_TIMER = 0x2; // Fx07 / skip on Vx / jump back loop waiting on the delay timer
+const uint8_t IDLE_KEY = 0x3;   // Fx0A with no key pressed
+
+uint8_t idle = 0x0;
+
+// the rom stays mapped read only for the life of the program
+// so it never has to be read from disk again
+const uint8_t *rom_image = NULL;
+size_t rom_size = 0;
+uint64_t rom_hash = 0;
+
 const uint32_t FONTSET_SIZE = 80;
 
 uint8_t fontset[80] =
@@ -92,13 +179,173 @@ uint8_t fontset[80] =
 
 /* DEBUG FUNCTIONS */
 
+/*
+    Write the mnemonic for an opcode into buf, using the names from
+    Cowgod's technical reference. Returns 0 for opcodes that are not
+    chip-8 instructions, which are shown as data words
+*/
+int disassemble(uint16_t op, char *buf, size_t size)
+{
+    uint16_t nnn = op & 0xFFFu;
+    uint8_t x = (op & 0xF00u) >> 8;
+    uint8_t y = (op & 0xF0u) >> 4;
+    uint8_t kk = op & 0xFFu;
+    uint8_t n = op & 0xFu;
+
+    switch (op >> 12)
+    {
+    case 0x0:
+        if (op == 0x00E0)
+            return snprintf(buf, size, "CLS") > 0;
+        if (op == 0x00EE)
+            return snprintf(buf, size, "RET") > 0;
+        return snprintf(buf, size, "SYS %03X", nnn) > 0;
+    case 0x1:
+        return snprintf(buf, size, "JP %03X", nnn) > 0;
+    case 0x2:
+        return snprintf(buf, size, "CALL %03X", nnn) > 0;
+    case 0x3:
+        return snprintf(buf, size, "SE V%X, %02X", x, kk) > 0;
+    case 0x4:
+        return snprintf(buf, size, "SNE V%X, %02X", x, kk) > 0;
+    case 0x5:
+        if (n == 0x0)
+            return snprintf(buf, size, "SE V%X, V%X", x, y) > 0;
+        break;
+    case 0x6:
+        return snprintf(buf, size, "LD V%X, %02X", x, kk) > 0;
+    case 0x7:
+        return snprintf(buf, size, "ADD V%X, %02X", x, kk) > 0;
+    case 0x8:
+    {
+        const char *names[0x10] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+                                   NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL};
+        if (names[n])
+            return snprintf(buf, size, "%s V%X, V%X", names[n], x, y) > 0;
+        break;
+    }
+    case 0x9:
+        if (n == 0x0)
+            return snprintf(buf, size, "SNE V%X, V%X", x, y) > 0;
+        break;
+    case 0xA:
+        return snprintf(buf, size, "LD I, %03X", nnn) > 0;
+    case 0xB:
+        return snprintf(buf, size, "JP V0, %03X", nnn) > 0;
+    case 0xC:
+        return snprintf(buf, size, "RND V%X, %02X", x, kk) > 0;
+    case 0xD:
+        return snprintf(buf, size, "DRW V%X, V%X, %X", x, y, n) > 0;
+    case 0xE:
+        if (kk == 0x9E)
+            return snprintf(buf, size, "SKP V%X", x) > 0;
+        if (kk == 0xA1)
+            return snprintf(buf, size, "SKNP V%X", x) > 0;
+        break;
+    case 0xF:
+        switch (kk)
+        {
+        case 0x07:
+            return snprintf(buf, size, "LD V%X, DT", x) > 0;
+        case 0x0A:
+            return snprintf(buf, size, "LD V%X, K", x) > 0;
+        case 0x15:
+            return snprintf(buf, size, "LD DT, V%X", x) > 0;
+        case 0x18:
+            return snprintf(buf, size, "LD ST, V%X", x) > 0;
+        case 0x1E:
+            return snprintf(buf, size, "ADD I, V%X", x) > 0;
+        case 0x29:
+            return snprintf(buf, size, "LD F, V%X", x) > 0;
+        case 0x33:
+            return snprintf(buf, size, "LD B, V%X", x) > 0;
+        case 0x55:
+            return snprintf(buf, size, "LD [I], V%X", x) > 0;
+        case 0x65:
+            return snprintf(buf, size, "LD V%X, [I]", x) > 0;
+        }
+        break;
+    }
+
+    snprintf(buf, size, "DW %04X", op);
+    return 0;
+}
+
+// debugger breakpoints on addresses, watchpoints on memory writes
+// and conditions on registers
+uint16_t breakpoints[16];
+uint8_t breakpoint_count = 0;
+
+uint16_t watchpoints[16];
+uint8_t watchpoint_count = 0;
+
+// a condition compares a register (0x10 is the index register) against a value
+// and breaks when it becomes true
+struct condition
+{
+    uint8_t reg;
+    char op;
+    uint16_t value;
+    uint8_t was_true;
+};
+
+struct condition conditions[8];
+uint8_t condition_count = 0;
+
+// step over and step out run until the stack is back at this depth with
+// the program counter at step_pc, -1 when not stepping
+int step_depth = -1;
+uint16_t step_pc = 0x0;
+
+// the first instruction after resuming runs without checking for a breakpoint
+// so execution can continue past the breakpoint it stopped on
+uint8_t resuming = 0x0;
+
+// last message from the debugger and the command being typed
+char debug_message[64] = "";
+char debug_command[32] = "";
+
+int is_breakpoint(uint16_t addr)
+{
+    for (int i = 0; i < breakpoint_count; i++)
+    {
+        if (breakpoints[i] == addr)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the terminal is only taken over once there is something to show in it
+uint8_t terminal = 0x0;
+
+/* Start curses the first time the terminal is used */
+void t_init()
+{
+    if (terminal)
+    {
+        return;
+    }
+    terminal = 0x1;
+
+    initscr();
+    cbreak();
+    noecho();
+    nodelay(stdscr, 1);
+    keypad(stdscr, 1);
+    refresh();
+}
+
 void print_state()
 {
+    t_init();
+    move(0, 0);
     if (prog_pause) {
         printw("=================    PAUSED    ================\n");
     }
     else {
-        printw("\n");
+        printw("                                               \n");
     }
     printw("================= SYSTEM STATE ================\n");
     printw("ProgramCounter: %4x           \n", program_counter);
@@ -122,16 +369,207 @@ void print_state()
         }
     }
     printw("===============================================\n");
+
+    // disassembly around the program counter, > marks the pc and * a breakpoint
+    mvprintw(8, 50, "Disassembly         ");
+    mvprintw(9, 50, "--------------------");
+    for (int i = 0; i < 16; i++)
+    {
+        uint16_t addr = (program_counter + (i - 4) * 2) & 0xFFEu;
+        char text[24];
+        disassemble((main_mem[addr] << 8) | main_mem[addr + 1], text, sizeof(text));
+        mvprintw(10 + i, 50, "%c%c%03x  %-14s", addr == program_counter ? '>' : ' ',
+                 is_breakpoint(addr) ? '*' : ' ', addr, text);
+    }
+
+    mvprintw(28, 0, "%-63s", debug_message);
+    if (prog_pause)
+    {
+        mvprintw(29, 0, "(debug) %-31s", debug_command);
+    }
+    else
+    {
+        mvprintw(29, 0, "%-39s", "");
+    }
     refresh();
 }
 
 /* END DEBUG FUNCTIONS*/
 
+/* INPUT MAPPING */
+
+/*
+    Keyboard scancodes and gamepad buttons map to a mask of the chip-8
+    keys they hold down. The key map file has one line per chip-8 key:
+
+    # key  bindings
+    5 W Up pad:dpup
+
+    Keyboard bindings are SDL scancode names with spaces written as _,
+    gamepad bindings are pad: followed by an SDL button name
+*/
+
+// default layout, the left side of a qwerty keyboard for keys 0 to F
+const char *DEFAULT_KEYS[16] = {"X", "1", "2", "3", "Q", "W", "E", "A", "S", "D", "Z", "C", "4", "R", "F", "V"};
+
+// gamepad directions follow the keys most roms use for movement
+const char *DEFAULT_BUTTONS[16] = {NULL, NULL, NULL, NULL, "b", "dpup", "a", "dpleft", "dpdown", "dpright",
+                                   NULL, NULL, NULL, NULL, NULL, NULL};
+
+uint16_t scancode_keys[SDL_NUM_SCANCODES] = {0};
+uint16_t button_keys[SDL_CONTROLLER_BUTTON_MAX] = {0};
+
+// set once any gamepad button is bound
+uint8_t uses_gamepad = 0x0;
+
+// number of bindings holding each chip-8 key down, copied to the keypad before each frame
+uint8_t keys_held[16] = {0};
+
+/* Bind a keyboard or pad: name to chip-8 key, returns 0 if there is no such key or button */
+int bind_key(const char *name, uint8_t key)
+{
+    if (!strncmp(name, "pad:", 4))
+    {
+        int button = SDL_GameControllerGetButtonFromString(name + 4);
+        if (button == SDL_CONTROLLER_BUTTON_INVALID)
+        {
+            return 0;
+        }
+        button_keys[button] |= 0x1u << key;
+        uses_gamepad = 0x1;
+        return 1;
+    }
+
+    char spaced[32];
+    snprintf(spaced, sizeof(spaced), "%s", name);
+    for (char *c = spaced; *c; c++)
+    {
+        *c = (*c == '_') ? ' ' : *c;
+    }
+    SDL_Scancode code = SDL_GetScancodeFromName(spaced);
+    if (code == SDL_SCANCODE_UNKNOWN)
+    {
+        return 0;
+    }
+    scancode_keys[code] |= 0x1u << key;
+    return 1;
+}
+
+/* Load the key map, the default layout is used when there is no file */
+void load_keymap(char *filename)
+{
+    memset(scancode_keys, 0, sizeof(scancode_keys));
+    memset(button_keys, 0, sizeof(button_keys));
+    uses_gamepad = 0x0;
+
+    if (!filename)
+    {
+        for (uint8_t key = 0; key < 16; key++)
+        {
+            bind_key(DEFAULT_KEYS[key], key);
+            if (DEFAULT_BUTTONS[key])
+            {
+                char name[16];
+                snprintf(name, sizeof(name), "pad:%s", DEFAULT_BUTTONS[key]);
+                bind_key(name, key);
+            }
+        }
+        return;
+    }
+
+    FILE *fd = fopen(filename, "r");
+    if (!fd)
+    {
+        printf("Could not read key map %s\n", filename);
+        exit(1);
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fd))
+    {
+        char *tok = strtok(line, " \t\r\n");
+        if (!tok || tok[0] == '#')
+        {
+            continue;
+        }
+        char *end;
+        uint8_t key = strtoul(tok, &end, 16);
+        if (tok[1] || *end)
+        {
+            printf("Bad chip-8 key %s in key map %s\n", tok, filename);
+            exit(1);
+        }
+        while ((tok = strtok(NULL, " \t\r\n")))
+        {
+            if (!bind_key(tok, key))
+            {
+                printf("Unknown key %s in key map %s\n", tok, filename);
+                exit(1);
+            }
+        }
+    }
+    fclose(fd);
+}
+
+/* Count a binding's keys as held or released */
+void press_keys(uint16_t mask, int down)
+{
+    for (int key = 0; key < 16; key++)
+    {
+        if (mask & (0x1u << key))
+        {
+            keys_held[key] += down ? 1 : (keys_held[key] ? -1 : 0);
+        }
+    }
+}
+
+/* END INPUT MAPPING */
+
 /* GRAPHICS */
 
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
+SDL_GameController *gamepad = NULL;
+
+// set by F5 to reset the rom before the next frame
+uint8_t restart = 0x0;
+
+// the performance hud is drawn over the display when enabled
+uint8_t hud = 0x0;
+SDL_Texture *hud_texture = NULL;
+
+// the hud is drawn at 4 times the resolution of the display
+const int HUD_WIDTH = 64 * 4;
+const int HUD_HEIGHT = 32 * 4;
+uint32_t hud_pixels[64 * 4 * 32 * 4];
+
+// one string per line of the hud, filled in once a second with the latest metrics
+char hud_text[5][48];
+
+/*
+    Glyphs for hud characters that are not hex digits,
+    in the same 4x5 layout as the fontset
+*/
+const char HUD_CHARS[] = "IPSRNTMOLUW.%- ";
+const uint8_t hud_glyphs[] =
+    {
+        0xE0, 0x40, 0x40, 0x40, 0xE0, // I
+        0xF0, 0x90, 0xF0, 0x80, 0x80, // P
+        0xF0, 0x80, 0xF0, 0x10, 0xF0, // S
+        0xE0, 0x90, 0xE0, 0xA0, 0x90, // R
+        0x90, 0xD0, 0xB0, 0x90, 0x90, // N
+        0xE0, 0x40, 0x40, 0x40, 0x40, // T
+        0x90, 0xF0, 0xF0, 0x90, 0x90, // M
+        0xF0, 0x90, 0x90, 0x90, 0xF0, // O
+        0x80, 0x80, 0x80, 0x80, 0xF0, // L
+        0x90, 0x90, 0x90, 0x90, 0xF0, // U
+        0x90, 0x90, 0xF0, 0xF0, 0x90, // W
+        0x00, 0x00, 0x00, 0x00, 0x40, // .
+        0x90, 0x10, 0x20, 0x40, 0x90, // %
+        0x00, 0x00, 0xF0, 0x00, 0x00, // -
+        0x00, 0x00, 0x00, 0x00, 0x00  //
+};
 
 /*
 
@@ -153,7 +591,9 @@ user_keypad       Keyboard
 /* initialize graphics */
 void g_init()
 {
-    if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO) < 0)
+    // there is no sound, and the gamepad subsystem is only started when the key map binds a button
+    uint32_t systems = SDL_INIT_VIDEO | (uses_gamepad ? SDL_INIT_GAMECONTROLLER : 0);
+    if (SDL_Init(systems) < 0)
     {
         printf("SDL_Init failed: %s\n", SDL_GetError());
         exit(1);
@@ -167,7 +607,11 @@ void g_init()
     }
 }
 
-/* poll for keyboard input and updae accordingly */
+/*
+    Handle the pending window, keyboard and gamepad events. Called once
+    per display frame, right before the frame's instructions run, which
+    is when the keypad is sampled from the bindings held down
+*/
 int g_poll()
 {
     int quit = 0;
@@ -186,122 +630,48 @@ int g_poll()
 
         case SDL_KEYDOWN:
         {
-            switch (event.key.keysym.sym)
-            {
-            case SDLK_ESCAPE:
-            {
-                quit = 1;
-            }
-            break;
-
-            case SDLK_x:
-            {
-                user_keypad[0] = 1;
-            }
-            break;
-
-            case SDLK_1:
-            {
-                user_keypad[1] = 1;
-            }
-            break;
-
-            case SDLK_2:
-            {
-                user_keypad[2] = 1;
-            }
-            break;
-
-            case SDLK_3:
+            if (!event.key.repeat)
             {
-                user_keypad[3] = 1;
+                press_keys(scancode_keys[event.key.keysym.scancode], 1);
             }
-            break;
-
-            case SDLK_q:
-            {
-                user_keypad[4] = 1;
-            }
-            break;
-
-            case SDLK_w:
-            {
-                user_keypad[5] = 1;
-            }
-            break;
-
-            case SDLK_e:
-            {
-                user_keypad[6] = 1;
-            }
-            break;
-
-            case SDLK_a:
-            {
-                user_keypad[7] = 1;
-            }
-            break;
-
-            case SDLK_s:
-            {
-                user_keypad[8] = 1;
-            }
-            break;
-
-            case SDLK_d:
-            {
-                user_keypad[9] = 1;
-            }
-            break;
-
-            case SDLK_z:
-            {
-                user_keypad[0xA] = 1;
-            }
-            break;
 
-            case SDLK_c:
+            switch (event.key.keysym.sym)
             {
-                user_keypad[0xB] = 1;
-            }
-            break;
-
-            case SDLK_4:
+            case SDLK_ESCAPE:
             {
-                user_keypad[0xC] = 1;
+                quit = 1;
             }
             break;
 
-            case SDLK_r:
+            case SDLK_F1:
             {
-                user_keypad[0xD] = 1;
+                if (ipf > 1)
+                    ipf--;
+                break;
             }
-            break;
-
-            case SDLK_f:
+            case SDLK_F2:
             {
-                user_keypad[0xE] = 1;
+                ipf++;
+                break;
             }
-            break;
-
-            case SDLK_v:
+            case SDLK_TAB:
             {
-                user_keypad[0xF] = 1;
+                turbo ^= 0x1;
+                break;
             }
-            break;
-
-            case SDLK_F1:
+            case SDLK_F3:
             {
-                speed += 1;
+                hud ^= 0x1;
                 break;
             }
-            case SDLK_F2:
+            case SDLK_F5:
             {
-                speed = (speed - 1) ? speed > 1 : 0;
+                restart = 0x1;
                 break;
             }
             case SDLK_SPACE: {
                 prog_pause ^= 0x1;
+                resuming = 0x1;
                 print_state();
                 break;
             }
@@ -312,110 +682,93 @@ int g_poll()
 
         case SDL_KEYUP:
         {
-            switch (event.key.keysym.sym)
-            {
-            case SDLK_x:
-            {
-                user_keypad[0] = 0;
-            }
-            break;
+            press_keys(scancode_keys[event.key.keysym.scancode], 0);
+        }
+        break;
 
-            case SDLK_1:
+        case SDL_CONTROLLERBUTTONDOWN:
+        case SDL_CONTROLLERBUTTONUP:
+        {
+            if (event.cbutton.button < SDL_CONTROLLER_BUTTON_MAX)
             {
-                user_keypad[1] = 0;
+                press_keys(button_keys[event.cbutton.button], event.type == SDL_CONTROLLERBUTTONDOWN);
             }
-            break;
+        }
+        break;
 
-            case SDLK_2:
+        case SDL_CONTROLLERDEVICEADDED:
+        {
+            if (!gamepad)
             {
-                user_keypad[2] = 0;
+                gamepad = SDL_GameControllerOpen(event.cdevice.which);
             }
-            break;
+        }
+        break;
+        }
+    }
 
-            case SDLK_3:
-            {
-                user_keypad[3] = 0;
-            }
-            break;
+    for (int key = 0; key < 16; key++)
+    {
+        user_keypad[key] = keys_held[key] != 0;
+    }
 
-            case SDLK_q:
-            {
-                user_keypad[4] = 0;
-            }
-            break;
+    return quit;
+}
 
-            case SDLK_w:
-            {
-                user_keypad[5] = 0;
-            }
-            break;
+/* draw the hud text into the hud pixels over a translucent background */
+void g_hud()
+{
+    for (int i = 0; i < HUD_WIDTH * HUD_HEIGHT; i++)
+    {
+        hud_pixels[i] = 0x0;
+    }
 
-            case SDLK_e:
-            {
-                user_keypad[6] = 0;
-            }
-            break;
+    for (int line = 0; line < 5; line++)
+    {
+        for (int col = 0; hud_text[line][col]; col++)
+        {
+            char c = hud_text[line][col];
+            const uint8_t *glyph = &hud_glyphs[(sizeof(HUD_CHARS) - 2) * 5];
 
-            case SDLK_a:
+            if (c >= '0' && c <= '9')
             {
-                user_keypad[7] = 0;
+                glyph = &fontset[(c - '0') * 5];
             }
-            break;
-
-            case SDLK_s:
+            else if (c >= 'A' && c <= 'F')
             {
-                user_keypad[8] = 0;
+                glyph = &fontset[(c - 'A' + 10) * 5];
             }
-            break;
-
-            case SDLK_d:
+            else if (strchr(HUD_CHARS, c))
             {
-                user_keypad[9] = 0;
+                glyph = &hud_glyphs[(strchr(HUD_CHARS, c) - HUD_CHARS) * 5];
             }
-            break;
 
-            case SDLK_z:
+            // each glyph takes a 5x7 cell with its background
+            for (int y = 0; y < 7; y++)
             {
-                user_keypad[0xA] = 0;
+                for (int x = 0; x < 5; x++)
+                {
+                    int px = 1 + col * 5 + x;
+                    int py = 1 + line * 7 + y;
+                    if (px >= HUD_WIDTH || py >= HUD_HEIGHT)
+                    {
+                        continue;
+                    }
+                    int on = y >= 1 && y <= 5 && (glyph[y - 1] & (0x80u >> x));
+                    hud_pixels[py * HUD_WIDTH + px] = on ? 0xFF40FF40 : 0xA0000000;
+                }
             }
-            break;
+        }
+    }
 
-            case SDLK_c:
-            {
-                user_keypad[0xB] = 0;
-            }
-            break;
-
-            case SDLK_4:
-            {
-                user_keypad[0xC] = 0;
-            }
-            break;
-
-            case SDLK_r:
-            {
-                user_keypad[0xD] = 0;
-            }
-            break;
-
-            case SDLK_f:
-            {
-                user_keypad[0xE] = 0;
-            }
-            break;
-
-            case SDLK_v:
-            {
-                user_keypad[0xF] = 0;
-            }
-            break;
-            }
-        }
-        break;
-        }
+    // the hud texture is made the first time the hud is shown
+    if (!hud_texture)
+    {
+        hud_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, HUD_WIDTH, HUD_HEIGHT);
+        SDL_SetTextureBlendMode(hud_texture, SDL_BLENDMODE_BLEND);
     }
-
-    return quit;
+    SDL_UpdateTexture(hud_texture, NULL, hud_pixels, sizeof(uint32_t) * HUD_WIDTH);
+    SDL_RenderCopy(renderer, hud_texture, NULL, NULL);
 }
 
 /* draw the updated video buffer to the window*/
@@ -424,12 +777,32 @@ void g_draw()
     SDL_RenderClear(renderer);
     SDL_UpdateTexture(texture, NULL, video, sizeof(uint32_t) * SCREEN_WIDTH);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
+    if (hud)
+    {
+        g_hud();
+    }
     SDL_RenderPresent(renderer);
 }
 
+/* show how fast the emulation runs compared to real time in the window title */
+void g_speed(double multiplier)
+{
+    char title[64];
+    snprintf(title, sizeof(title), "Chip-8%s %.1fx", turbo ? " [turbo]" : "", multiplier);
+    SDL_SetWindowTitle(window, title);
+}
+
 /* cleanup function*/
 void g_cleanup()
 {
+    if (gamepad)
+    {
+        SDL_GameControllerClose(gamepad);
+    }
+    if (hud_texture)
+    {
+        SDL_DestroyTexture(hud_texture);
+    }
     SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
@@ -438,617 +811,4219 @@ void g_cleanup()
 
 /* END GRAPHICS */
 
-/* SYSTEM SETUP */
+/* PERFORMANCE METRICS */
 
-/* Read the rom provided into program memory starting at PROGSTART */
-void read_rom(uint8_t *main_mem, char *filename)
+// a json line of metrics is written here every second when set
+FILE *metrics_out = NULL;
+
+// totals for the current one second window, times are performance counter ticks
+struct metrics
 {
-    FILE *fd;
-    fd = fopen(filename, "rb");
-    if (!fd)
+    uint64_t start;
+    uint64_t run;
+    uint64_t instructions;
+    uint32_t frames;
+    uint64_t poll;
+    uint64_t cycle;
+    uint64_t draw;
+    uint32_t presents;
+    uint64_t present_time[1024];
+};
+
+struct metrics metrics;
+
+// emulated time minus real time since startup, ignoring time spent paused
+double timer_drift_ms = 0.0;
+
+/* start a new metrics window */
+void metrics_reset()
+{
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.start = SDL_GetPerformanceCounter();
+}
+
+/* record how long one g_draw took */
+void metrics_present(uint64_t time)
+{
+    if (metrics.presents < sizeof(metrics.present_time) / sizeof(metrics.present_time[0]))
     {
-        printf("Could not read rom %s\n", filename);
-        exit(1);
+        metrics.present_time[metrics.presents++] = time;
     }
+}
 
-    fseek(fd, 0, SEEK_END);
-    int size = ftell(fd);
-    fseek(fd, 0, SEEK_SET);
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    if (size > (0xFFF - 0x200))
+/* once a window has lasted a second, publish it to the title, the hud and the metrics file */
+void metrics_report()
+{
+    uint64_t now = SDL_GetPerformanceCounter();
+    double freq = (double)SDL_GetPerformanceFrequency();
+    double elapsed = (now - metrics.start) / freq;
+    if (elapsed < 1.0)
     {
-        printf("ROM too large!\n");
-        exit(1);
+        return;
     }
 
-    fread(&main_mem[PROGSTART], sizeof(char), size, fd);
+    double ips = metrics.instructions / elapsed;
+    double fps = metrics.frames / elapsed;
+    double to_ms = 1000.0 / freq;
+
+    // the timers tick once per emulated frame and should do so 60 times a second
+    timer_drift_ms += metrics.frames * 1000.0 / 60.0 - metrics.run * to_ms;
 
-    if (ferror(fd))
+    double present_min = 0.0, present_avg = 0.0, present_p99 = 0.0, present_max = 0.0;
+    if (metrics.presents)
     {
-        printf("Error writing rom to memory\n");
-        exit(1);
+        qsort(metrics.present_time, metrics.presents, sizeof(uint64_t), compare_u64);
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < metrics.presents; i++)
+        {
+            total += metrics.present_time[i];
+        }
+        present_min = metrics.present_time[0] * to_ms;
+        present_avg = total * to_ms / metrics.presents;
+        present_p99 = metrics.present_time[(metrics.presents - 1) * 99 / 100] * to_ms;
+        present_max = metrics.present_time[metrics.presents - 1] * to_ms;
     }
 
-    fclose(fd);
-}
+    double poll_pct = metrics.poll * to_ms / (elapsed * 10.0);
+    double cycle_pct = metrics.cycle * to_ms / (elapsed * 10.0);
+    double draw_pct = metrics.draw * to_ms / (elapsed * 10.0);
 
-/* Load the fontset into memory
-    The fontset can be stored anywhere from 0x000 up to 0x1FF
-    I chose to store it starting at 0x050
-*/
-void load_fontset(uint8_t *main_mem, uint8_t *font, uint32_t size)
-{
-    for (uint32_t i = 0; i < size; i++)
+    g_speed(fps / 60.0);
+
+    snprintf(hud_text[0], sizeof(hud_text[0]), "IPS %.0f", ips);
+    snprintf(hud_text[1], sizeof(hud_text[1]), "FPS %.1f PRESENTS %u", fps, metrics.presents);
+    snprintf(hud_text[2], sizeof(hud_text[2]), "PRESENT %.2f %.2f %.2f MS", present_min, present_avg, present_max);
+    snprintf(hud_text[3], sizeof(hud_text[3]), "POLL %.1f%% CPU %.1f%% DRAW %.1f%%", poll_pct, cycle_pct, draw_pct);
+    snprintf(hud_text[4], sizeof(hud_text[4]), "DRIFT %.0f MS", timer_drift_ms);
+
+    if (metrics_out)
     {
-        main_mem[FONTSTART + i] = font[i];
+        fprintf(metrics_out,
+                "{\"ips\":%.0f,\"fps\":%.2f,\"presents\":%u,"
+                "\"present_ms\":{\"min\":%.3f,\"avg\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+                "\"poll_pct\":%.2f,\"cycle_pct\":%.2f,\"draw_pct\":%.2f,\"drift_ms\":%.1f}\n",
+                ips, fps, metrics.presents, present_min, present_avg, present_p99, present_max,
+                poll_pct, cycle_pct, draw_pct, timer_drift_ms);
+        fflush(metrics_out);
     }
-}
 
-/* END SYSTEM SETUP */
+    metrics_reset();
+}
 
-/* OPCODE IMPLIMENTATIONS */
+/* END PERFORMANCE METRICS */
 
-// program_counter must be incrimented by 2 before
-// executing these opcodes
+/* SYSTEM SETUP */
 
-/* (Sys) JUMP to address NNN*/
-void op_0NNN()
+/* FNV-1a hash, used to key roms in the rom database and to compare displays */
+uint64_t hash_bytes(const void *data, size_t size)
 {
-    program_counter = opcode & 0x0FFFu;
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xCBF29CE484222325u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3u;
+    }
+    return hash;
 }
 
-/* Clear the display*/
-void op_00E0()
+/* Pack a row of 64 pixels one bit per pixel, leftmost pixel in the top bit */
+uint64_t pack_row(const uint32_t *p)
 {
-    memset(video, 0, sizeof(uint32_t) * 64 * 32);
+    // pixels are all ones or all zeros so each can be masked straight into its bit
+    uint64_t row = 0;
+    for (int x = 0; x < SCREEN_WIDTH; x += 8)
+    {
+        uint32_t byte = (p[x] & 0x80u) | (p[x + 1] & 0x40u) | (p[x + 2] & 0x20u) | (p[x + 3] & 0x10u) |
+                        (p[x + 4] & 0x8u) | (p[x + 5] & 0x4u) | (p[x + 6] & 0x2u) | (p[x + 7] & 0x1u);
+        row = (row << 8) | byte;
+    }
+    return row;
 }
 
-/* Return from a subroutine */
-void op_00EE()
+/* Row y of the display packed one bit per pixel */
+uint64_t display_row(int y)
 {
-    stack_pointer--;
-    program_counter = stack[stack_pointer];
+    return pack_row(&video[y * SCREEN_WIDTH]);
 }
 
-/* JUMP to address NNN*/
-void op_1NNN()
+/* Copy a rom image into program memory starting at PROGSTART */
+void load_rom_image(uint8_t *main_mem, const uint8_t *image, size_t size, uint64_t hash)
 {
-    program_counter = opcode & 0x0FFFu;
-}
+    rom_image = image;
+    rom_size = size;
+    rom_hash = hash;
 
-/* CALL subroutine at nnn*/
-void op_2NNN()
-{
-    stack[stack_pointer] = program_counter;
-    stack_pointer++;
-    program_counter = opcode & 0x0FFFu;
+    memcpy(&main_mem[PROGSTART], rom_image, rom_size);
 }
 
-/* Skip next instruction if Vx == kk*/
-void op_3xkk()
+/*
+    Map the rom provided and copy it into program memory starting at PROGSTART.
+    Returns what went wrong, or NULL once the rom is loaded
+*/
+const char *map_rom(uint8_t *main_mem, char *filename)
 {
-    uint8_t reg = (opcode & 0xF00u) >> 8u;
-    uint8_t kk = (opcode & 0xFFu);
-    if (registers[reg] == kk)
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
-        program_counter += 2;
+        return "Could not read rom";
     }
-}
-/* Skip next instruction if Vx = Vy. */
 
-/* Skip next instruction if Vx != kk*/
-void op_4xkk()
-{
-    uint8_t reg = (opcode & 0xF00u) >> 8u;
-    uint8_t kk = (opcode & 0xFFu);
-    if (registers[reg] != kk)
+    struct stat st;
+    if (fstat(fd, &st) < 0)
     {
-        program_counter += 2;
+        close(fd);
+        return "Could not read rom";
     }
-}
 
-/*Skip next instruction if Vx = Vy.*/
-void op_5xy0()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t y = (opcode & 0xF0u) >> 4;
-    if (registers[x] == registers[y])
+    size_t size = st.st_size;
+
+    if (size == 0 || size > ROM_MAX)
     {
-        program_counter += 2;
+        close(fd);
+        return size ? "ROM too large!" : "ROM is empty!";
     }
-}
 
-/*Set Vx == kk*/
-void op_6xkk()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t kk = (opcode & 0xFFu);
-    registers[x] = kk;
-}
+    void *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-/*Add kk to Vx*/
-void op_7xkk()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t kk = (opcode & 0xFFu);
-    registers[x] = registers[x] + kk;
-}
+    if (image == MAP_FAILED)
+    {
+        return "Error mapping rom";
+    }
 
-/*Set Vx = Vy*/
-void op_8xy0()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t y = (opcode & 0xF0u) >> 4;
-    registers[x] = registers[y];
+    load_rom_image(main_mem, image, size, hash_bytes(image, size));
+    return NULL;
 }
 
-/*Set Vx = Vx | Vy*/
-void op_8xy1()
+/* Load the rom provided, giving up on the program if it cannot be */
+void read_rom(uint8_t *main_mem, char *filename)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t y = (opcode & 0xF0u) >> 4;
-    registers[x] |= registers[y];
+    const char *err = map_rom(main_mem, filename);
+    if (err)
+    {
+        printf("%s %s\n", err, filename);
+        exit(1);
+    }
 }
 
-/*Set Vx = Vx & vy*/
-void op_8xy2()
+/* per rom settings from the rom database */
+struct romdb_entry
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t y = (opcode & 0xF0u) >> 4;
-    registers[x] &= registers[y];
-}
+    uint64_t hash;
+    uint32_t ipf;
+    uint8_t quirks;
+    // hash of the display after running headless for frames frames
+    uint32_t frames;
+    uint64_t golden;
+    // key map file for the rom, NULL for the default layout
+    char *keymap;
+};
 
-/*Set Vx = Vx ^ vy*/
-void op_8xy3()
+struct romdb_entry *romdb = NULL;
+size_t romdb_len = 0;
+
+// key map of the loaded rom from the database, a key map given with -k wins over it
+char *rom_keymap = NULL;
+
+/* order database entries by hash so lookups can binary search */
+int compare_romdb(const void *a, const void *b)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t y = (opcode & 0xF0u) >> 4;
-    registers[x] ^= registers[y];
+    uint64_t x = ((const struct romdb_entry *)a)->hash;
+    uint64_t y = ((const struct romdb_entry *)b)->hash;
+    return (x > y) - (x < y);
 }
 
-/*Set Vx = Vx + Vy, set VF = carry*/
-void op_8xy4()
+/*
+    Read the rom database into memory once at startup.
+    Each line of the database holds the hash, a name, and settings:
+
+    # comment
+    9a3f04b0c1d2e3f4 pong ipf=12 quirks=shift,loadstore keymap=roms/pong.keys frames=600 golden=1c2d...
+
+    A missing database leaves every rom on the defaults.
+    Returns -1 if there was not the memory to hold it
+*/
+int load_romdb(char *filename)
 {
-    uint8_t x = (opcode & 0x0F00u) >> 8u;
-    uint8_t y = (opcode & 0x00F0u) >> 4u;
-    uint16_t res = registers[x] + registers[y];
+    FILE *fd = fopen(filename, "r");
+    if (!fd)
+    {
+        return 0;
+    }
 
-    if (x == 0xF)
+    char line[256];
+    size_t cap = 0;
+    while (fgets(line, sizeof(line), fd))
     {
-        registers[x] = res & 0xFFu;
-        if (res > 255)
+        // a line too long for the buffer would be read back as several entries
+        if (!strchr(line, '\n') && !feof(fd))
         {
-            registers[0xF] = 1;
+            printf("Skipping rom database line longer than %zu bytes in %s\n", sizeof(line) - 2, filename);
+            int c;
+            while ((c = fgetc(fd)) != '\n' && c != EOF)
+            {
+            }
+            continue;
         }
-        else
+
+        char *tok = strtok(line, " \t\r\n");
+        if (!tok || tok[0] == '#')
         {
-            registers[0xF] = 0;
+            continue;
         }
-    }
-    else
-    {
-        if (res > 255)
+
+        if (romdb_len == cap)
         {
-            registers[0xF] = 1;
+            cap = cap ? cap * 2 : 64;
+            struct romdb_entry *grown = realloc(romdb, cap * sizeof(struct romdb_entry));
+            if (!grown)
+            {
+                fclose(fd);
+                return -1;
+            }
+            romdb = grown;
         }
-        else
+
+        struct romdb_entry *entry = &romdb[romdb_len++];
+        memset(entry, 0, sizeof(*entry));
+        entry->hash = strtoull(tok, NULL, 16);
+
+        // skip the name
+        strtok(NULL, " \t\r\n");
+
+        while ((tok = strtok(NULL, " \t\r\n")))
         {
-            registers[0xF] = 0;
+            if (!strncmp(tok, "ipf=", 4))
+            {
+                entry->ipf = strtoul(tok + 4, NULL, 10);
+            }
+            else if (!strncmp(tok, "quirks=", 7))
+            {
+                if (strstr(tok, "shift"))
+                    entry->quirks |= QUIRK_SHIFT;
+                if (strstr(tok, "loadstore"))
+                    entry->quirks |= QUIRK_LOADSTORE;
+                if (strstr(tok, "jump"))
+                    entry->quirks |= QUIRK_JUMP;
+                if (strstr(tok, "vip"))
+                    entry->quirks |= QUIRK_VIP;
+            }
+            else if (!strncmp(tok, "frames=", 7))
+            {
+                entry->frames = strtoul(tok + 7, NULL, 10);
+            }
+            else if (!strncmp(tok, "golden=", 7))
+            {
+                entry->golden = strtoull(tok + 7, NULL, 16);
+            }
+            else if (!strncmp(tok, "keymap=", 7))
+            {
+                entry->keymap = strdup(tok + 7);
+                if (!entry->keymap)
+                {
+                    fclose(fd);
+                    return -1;
+                }
+            }
         }
+    }
 
-        registers[x] = res & 0xFFu;
+    fclose(fd);
+
+    // sorted once so each lookup is a binary search however large the corpus
+    if (romdb_len)
+    {
+        qsort(romdb, romdb_len, sizeof(struct romdb_entry), compare_romdb);
     }
+    return 0;
 }
 
-/*
- Set Vx = Vx - Vy, set VF = NOT borrow
- If Vx > Vy, then VF is set to 1, otherwise 0.
- Then Vy is subtracted from Vx, and the results stored in Vx.
-*/
-void op_8xy5()
+/* Find the database entry for a rom hash, NULL if the rom is unknown */
+struct romdb_entry *find_romdb(uint64_t hash)
 {
-    uint8_t x = (opcode & 0x0F00u) >> 8u;
-    uint8_t y = (opcode & 0x00F0u) >> 4u;
+    struct romdb_entry key = {0};
+    key.hash = hash;
+    return romdb_len ? bsearch(&key, romdb, romdb_len, sizeof(struct romdb_entry), compare_romdb) : NULL;
+}
 
-    if (registers[x] > registers[y])
+/* Apply the settings for the loaded rom, unknown roms keep the defaults */
+void apply_romdb()
+{
+    struct romdb_entry *entry = find_romdb(rom_hash);
+    quirks = forced_quirks;
+    rom_keymap = NULL;
+    if (!entry)
     {
-        registers[0xF] = 1;
+        return;
     }
-    else
+    rom_keymap = entry->keymap;
+    if (entry->ipf)
     {
-        registers[0xF] = 0;
+        ipf = entry->ipf;
     }
-
-    registers[x] -= registers[y];
+    quirks |= entry->quirks;
 }
 
-/*
- If the least-significant bit of Vx is 1,
- then VF is set to 1, otherwise 0. Then Vx is divided by 2.
+/* Load the fontset into memory
+    The fontset can be stored anywhere from 0x000 up to 0x1FF
+    I chose to store it starting at 0x050
 */
-void op_8xy6()
+void load_fontset(uint8_t *main_mem, uint8_t *font, uint32_t size)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    // saving lsb int CARRY
-    if (registers[x] & 0x1)
-    {
-        registers[0xF] = 1;
-    }
-    else
+    for (uint32_t i = 0; i < size; i++)
     {
-        registers[0xF] = 0;
+        main_mem[FONTSTART + i] = font[i];
     }
-    registers[x] >>= 1;
 }
 
-/*  Set Vx = Vy - Vx, set VF = NOT borrow */
-void op_8xy7()
+/* Copy the registers of the running machine out of the globals, its memory and display are already in m */
+void save_machine(struct machine *m)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8u;
-    uint8_t y = (opcode & 0xF0u) >> 4u;
-    if (registers[y] > registers[x])
-    {
-        registers[0xF] = 1;
-    }
-    else
-    {
-        registers[0xF] = 0;
-    }
-    registers[x] = registers[y] - registers[x];
+    memcpy(m->registers, registers, sizeof(registers));
+    memcpy(m->user_keypad, user_keypad, sizeof(user_keypad));
+    m->index_register = index_register;
+    memcpy(m->stack, stack, sizeof(stack));
+    m->stack_pointer = stack_pointer;
+    m->program_counter = program_counter;
+    m->opcode = opcode;
+    m->delay_timer = delay_timer;
+    m->sound_timer = sound_timer;
+    m->idle = idle;
+    m->vip_clock = vip_clock;
+    m->rng_state = rng_state;
 }
 
-/*
- If the most-significant bit of Vx is 1,
-  then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2.
-*/
-void op_8xyE()
+/* Make m the running machine, its memory and display are used in place */
+void load_machine(struct machine *m)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8u;
-    // saving msb into CARRY
-    registers[0xF] = (registers[x] & 0x80) >> 7u;
-    registers[x] <<= 1;
+    memcpy(registers, m->registers, sizeof(registers));
+    memcpy(user_keypad, m->user_keypad, sizeof(user_keypad));
+    main_mem = m->main_mem;
+    index_register = m->index_register;
+    memcpy(stack, m->stack, sizeof(stack));
+    stack_pointer = m->stack_pointer;
+    program_counter = m->program_counter;
+    opcode = m->opcode;
+    delay_timer = m->delay_timer;
+    sound_timer = m->sound_timer;
+    idle = m->idle;
+    vip_clock = m->vip_clock;
+    rng_state = m->rng_state;
+    video = m->video;
 }
 
-/*Skip next instruction if Vx != Vy*/
-void op_9xy0()
+// the console as it powers on with the rom loaded
+struct machine pristine;
+
+/* Keep the console's freshly loaded state so it can be reset without reloading the rom */
+void save_pristine()
 {
-    uint8_t x = (opcode & 0xF00u) >> 8u;
-    uint8_t y = (opcode & 0xF0u) >> 4u;
-    if (registers[x] != registers[y])
-    {
-        program_counter += 2;
-    }
+    save_machine(&console);
+    pristine = console;
 }
 
-/*The value of register I is set to nnn*/
-void op_Annn()
+/* Reset the console to the loaded rom's power on state with one copy of the pristine image */
+void restart_machine()
 {
-    index_register = (opcode & 0xFFFu);
+    console = pristine;
+    load_machine(&console);
 }
 
-/*Jump to location nnn + V0*/
-void op_Bnnn()
+/* Put the machine back into its power on state with the fontset loaded */
+void reset_machine()
 {
-    program_counter = ((opcode & 0xFFFu) + registers[0]);
+    memset(registers, 0, sizeof(registers));
+    memset(user_keypad, 0, sizeof(user_keypad));
+    memset(main_mem, 0, sizeof(console.main_mem));
+    memset(stack, 0, sizeof(stack));
+    memset(video, 0, sizeof(console.video));
+    index_register = 0x0;
+    stack_pointer = 0;
+    program_counter = PROGSTART;
+    opcode = 0x0;
+    delay_timer = 0x0;
+    sound_timer = 0x0;
+    ipf = DEFAULT_IPF;
+    quirks = 0x0;
+    vip_clock = 0;
+    rng_state = RNG_SEED;
+
+    load_fontset(main_mem, fontset, FONTSET_SIZE);
 }
 
-/* Set Vx = random byte AND kk */
-void op_Cxkk()
+/* END SYSTEM SETUP */
+
+/* ROM BUNDLES */
+
+/*
+    A bundle packs many roms into one file so a whole corpus
+    can be opened with a single mmap. All fields are host endian.
+
+    header      magic, version, rom count
+    index       one bundle_entry per rom
+    images      each rom starts on a 4KiB boundary
+*/
+
+const char BUNDLE_MAGIC[8] = "C8BUNDLE";
+const uint32_t BUNDLE_VERSION = 1;
+const uint32_t BUNDLE_ALIGN = 0x1000;
+
+struct bundle_header
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t kk = (opcode & 0xFFu);
-    registers[x] = (rand() % 256u) & kk;
-}
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
 
-/* Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision. */
-void op_Dxyn()
+struct bundle_entry
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t y = (opcode & 0xF0u) >> 4;
-    uint8_t height = (opcode & 0xFu);
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t size;
+    char name[48];
+};
 
-    // wrap around if trying to write off screen
-    uint8_t xPos = registers[x] % SCREEN_WIDTH;
-    uint8_t yPos = registers[y] % SCREEN_HEIGHT;
+const uint8_t *bundle = NULL;
+size_t bundle_size = 0;
+const struct bundle_entry *bundle_index = NULL;
+uint32_t bundle_count = 0;
 
-    // if there are no collisions the carry flag is set to 0
-    registers[0xF] = 0;
+// the index sorted by hash and by name for looking roms up
+const struct bundle_entry **bundle_by_hash = NULL;
+const struct bundle_entry **bundle_by_name = NULL;
 
-    for (int i = 0; i < height; i++)
-    {
-        uint8_t spriteByte = main_mem[index_register + i];
-        for (int j = 0; j < 8; j++)
-        {
-            uint8_t spritePixel = spriteByte & (0x80u >> j);
-            uint32_t *screenPixel = &video[(yPos + i) * SCREEN_WIDTH + (xPos + j)];
-            if (spritePixel)
-            {
-                if (*screenPixel == 0xFFFFFFFF)
-                {
-                    // if there is a collision between
-                    // what is on the screen and the sprite
-                    // we are trying to draw we set the vf flag
-                    registers[0xF] = 1;
-                }
+/* order bundle entries by hash */
+int compare_bundle_hash(const void *a, const void *b)
+{
+    uint64_t x = (*(const struct bundle_entry **)a)->hash;
+    uint64_t y = (*(const struct bundle_entry **)b)->hash;
+    return (x > y) - (x < y);
+}
 
-                // xor the screen
-                *screenPixel ^= 0xFFFFFFFF;
-            }
-        }
-    }
+/* order bundle entries by name */
+int compare_bundle_name(const void *a, const void *b)
+{
+    const struct bundle_entry *x = *(const struct bundle_entry **)a;
+    const struct bundle_entry *y = *(const struct bundle_entry **)b;
+    return strncmp(x->name, y->name, sizeof(x->name));
 }
 
-/* Skip next instruction if key with the value of Vx is pressed. */
-void op_Ex9E()
+/* Map a bundle and check that its index stays inside the file */
+void open_bundle(char *filename)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    if (user_keypad[registers[x]])
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
-        program_counter += 2;
+        printf("Could not read bundle %s\n", filename);
+        exit(1);
     }
-}
 
-/* Skip next instruction if key with the value of Vx is not pressed. */
-void op_ExA1()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    if (!user_keypad[registers[x]])
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct bundle_header))
     {
-        program_counter += 2;
+        printf("Bad bundle %s\n", filename);
+        exit(1);
     }
-}
 
-/* Set Vx = delay timer value */
-void op_Fx07()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8u;
-    registers[x] = delay_timer;
-}
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-/* Wait for a key press, store the value of the key in Vx */
-void op_Fx0A()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    for (int i = 0; i < 16; i++)
+    if (image == MAP_FAILED)
     {
-        if (user_keypad[i])
+        printf("Error mapping bundle %s\n", filename);
+        exit(1);
+    }
+
+    bundle = image;
+    bundle_size = st.st_size;
+
+    const struct bundle_header *header = image;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) || header->version != BUNDLE_VERSION ||
+        header->count > (bundle_size - sizeof(struct bundle_header)) / sizeof(struct bundle_entry))
+    {
+        printf("Bad bundle %s\n", filename);
+        exit(1);
+    }
+
+    bundle_count = header->count;
+    bundle_index = (const struct bundle_entry *)(bundle + sizeof(struct bundle_header));
+
+    for (uint32_t i = 0; i < bundle_count; i++)
+    {
+        const struct bundle_entry *entry = &bundle_index[i];
+        if (entry->size == 0 || entry->size > ROM_MAX || entry->offset > bundle_size ||
+            entry->size > bundle_size - entry->offset)
         {
-            // key is pressed so we can store its value in x
-            registers[x] = (uint8_t)i;
-            return;
+            printf("Bad bundle %s\n", filename);
+            exit(1);
         }
     }
-    // if no user_keypad are pressed we can
-    // effectively sleep by decrementing the pc by 2
-    // causing this instruction to run again next cycle
-    program_counter -= 2;
-    if (delay_timer > 0)
-        delay_timer -= 1;
-    if (sound_timer > 0)
-        sound_timer -= 1;
-}
 
-/* Set dealy timer = Vx */
-void op_Fx15()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    delay_timer = registers[x];
+    bundle_by_hash = malloc(bundle_count * sizeof(*bundle_by_hash));
+    bundle_by_name = malloc(bundle_count * sizeof(*bundle_by_name));
+    if (bundle_count && (!bundle_by_hash || !bundle_by_name))
+    {
+        printf("Out of memory opening bundle %s\n", filename);
+        exit(1);
+    }
+    for (uint32_t i = 0; i < bundle_count; i++)
+    {
+        bundle_by_hash[i] = bundle_by_name[i] = &bundle_index[i];
+    }
+    qsort(bundle_by_hash, bundle_count, sizeof(*bundle_by_hash), compare_bundle_hash);
+    qsort(bundle_by_name, bundle_count, sizeof(*bundle_by_name), compare_bundle_name);
 }
 
-/* Set sound timer = Vx */
-void op_Fx18()
+/* Find a rom in the bundle by name or by its 16 digit hash */
+const struct bundle_entry *find_bundle_entry(const char *key)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    sound_timer = registers[x];
-}
+    int is_hash = strlen(key) == 16 && strspn(key, "0123456789abcdefABCDEF") == 16;
+    if (!bundle_count)
+    {
+        return NULL;
+    }
 
-void op_Fx1E()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    index_register += registers[x];
+    struct bundle_entry wanted = {0};
+    const struct bundle_entry *target = &wanted;
+    const struct bundle_entry **found;
+    if (is_hash)
+    {
+        wanted.hash = strtoull(key, NULL, 16);
+        found = bsearch(&target, bundle_by_hash, bundle_count, sizeof(*found), compare_bundle_hash);
+    }
+    else
+    {
+        strncpy(wanted.name, key, sizeof(wanted.name) - 1);
+        found = bsearch(&target, bundle_by_name, bundle_count, sizeof(*found), compare_bundle_name);
+    }
+    return found ? *found : NULL;
 }
 
-/*Set index register = location of sprite for digit Vx*/
-void op_Fx29()
+/* Pack the roms given into a new bundle */
+int pack_bundle(char *filename, char **roms, int count)
 {
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    index_register = FONTSTART + (registers[x] * 5);
-}
+    struct bundle_entry *index = calloc(count, sizeof(struct bundle_entry));
+    uint8_t *images = calloc(count, ROM_MAX);
+    if (!index || !images)
+    {
+        printf("Out of memory packing bundle\n");
+        return 1;
+    }
 
-/*
-Store BCD representation of Vx in memory locations I, I+1, and I+2.
+    size_t index_end = sizeof(struct bundle_header) + count * sizeof(struct bundle_entry);
+    uint32_t offset = (index_end + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1);
 
-The interpreter takes the decimal value of Vx,
-and places the hundreds digit in memory at location in I,
-the tens digit at location I+1, and the ones digit at location I+2.
-*/
-void op_Fx33()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    uint8_t digit = registers[x];
-    main_mem[index_register + 2] = (digit % 10);
-    digit /= 10;
-    main_mem[index_register + 1] = (digit % 10);
-    digit /= 10;
-    main_mem[index_register] = (digit % 10);
-}
+    for (int i = 0; i < count; i++)
+    {
+        FILE *fd = fopen(roms[i], "rb");
+        if (!fd)
+        {
+            printf("Could not read rom %s\n", roms[i]);
+            return 1;
+        }
+        size_t size = fread(&images[i * ROM_MAX], 1, ROM_MAX, fd);
+        int too_large = fgetc(fd) != EOF;
+        fclose(fd);
 
-/* Store registers V0 through Vx in memory starting at location I */
-void op_Fx55()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    for (int i = 0; i <= x; i++)
+        if (size == 0 || too_large)
+        {
+            printf("Bad rom size %s\n", roms[i]);
+            return 1;
+        }
+
+        // name the rom after its file without the directory or extension
+        char *name = strrchr(roms[i], '/');
+        name = name ? name + 1 : roms[i];
+        size_t len = strcspn(name, ".");
+        if (len >= sizeof(index[i].name))
+        {
+            len = sizeof(index[i].name) - 1;
+        }
+        memcpy(index[i].name, name, len);
+
+        index[i].hash = hash_bytes(&images[i * ROM_MAX], size);
+        index[i].offset = offset;
+        index[i].size = size;
+        offset += BUNDLE_ALIGN;
+    }
+
+    FILE *out = fopen(filename, "wb");
+    if (!out)
     {
-        main_mem[index_register + i] = registers[i];
+        printf("Could not write bundle %s\n", filename);
+        return 1;
     }
-}
 
-/* Read registers V0 through Vx in memory starting at location I */
-void op_Fx65()
-{
-    uint8_t x = (opcode & 0xF00u) >> 8;
-    for (int i = 0; i <= x; i++)
+    struct bundle_header header = {{0}, BUNDLE_VERSION, count};
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(index, sizeof(struct bundle_entry), count, out);
+
+    for (int i = 0; i < count; i++)
     {
-        registers[i] = main_mem[index_register + i];
+        fseek(out, index[i].offset, SEEK_SET);
+        fwrite(&images[i * ROM_MAX], 1, index[i].size, out);
     }
-}
 
-/* END OPCODE IMPLIMENTATIONS*/
+    int err = ferror(out);
+    fclose(out);
+    free(index);
+    free(images);
 
-/* Set up function table for opcodes*/
+    if (err)
+    {
+        printf("Error writing bundle %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
 
-void (*zero_table[0x2])() = {&op_00E0, &op_00EE};
+/* END ROM BUNDLES */
 
-void (*eight_table[0x10])();
+/* OPCODE IMPLIMENTATIONS */
 
-void (*F_table[0x65 + 1])();
+// program_counter must be incrimented by 2 before
+// executing these opcodes
 
-void setup_functables()
+/* (Sys) JUMP to address NNN*/
+void op_0NNN()
 {
-    eight_table[0x0] = &op_8xy0,
-    eight_table[0x1] = &op_8xy1,
-    eight_table[0x2] = &op_8xy2,
-    eight_table[0x3] = &op_8xy3,
-    eight_table[0x4] = &op_8xy4,
-    eight_table[0x5] = &op_8xy5,
-    eight_table[0x6] = &op_8xy6,
-    eight_table[0x7] = &op_8xy7,
-    eight_table[0xE] = &op_8xyE,
-    F_table[0x07] = &op_Fx07;
-    F_table[0x0A] = &op_Fx0A;
-    F_table[0x15] = &op_Fx15;
-    F_table[0x18] = &op_Fx18;
-    F_table[0x1E] = &op_Fx1E;
-    F_table[0x29] = &op_Fx29;
-    F_table[0x33] = &op_Fx33;
-    F_table[0x55] = &op_Fx55;
-    F_table[0x65] = &op_Fx65;
+    program_counter = opcode & 0x0FFFu;
+}
 
+/* Clear the display*/
+void op_00E0()
+{
+    memset(video, 0, sizeof(uint32_t) * 64 * 32);
 }
 
-void exc_zero_codes()
+/* Return from a subroutine */
+void op_00EE()
 {
-    (*zero_table[(opcode >> 1) & 0x1])();
+    // the stack wraps around instead of underflowing
+    stack_pointer = (stack_pointer - 1) & 0xFu;
+    program_counter = stack[stack_pointer];
 }
 
-void exc_eight_codes()
+/* Check for a loop at addr that only polls the delay timer
+    Fx07        Vx = delay timer
+    3xkk/4xkk   skip the jump back on Vx
+    1addr
+*/
+int is_timer_poll(uint16_t addr)
 {
-    (*eight_table[opcode & 0xF])();
+    uint16_t load = (main_mem[addr & 0xFFFu] << 8) | main_mem[(addr + 1) & 0xFFFu];
+    uint16_t skip = (main_mem[(addr + 2) & 0xFFFu] << 8) | main_mem[(addr + 3) & 0xFFFu];
+    return (load & 0xF0FFu) == 0xF007u && ((skip & 0xF000u) == 0x3000u || (skip & 0xF000u) == 0x4000u) &&
+           (skip & 0x0F00u) == (load & 0x0F00u);
 }
 
-// no table for E codes just a simple switch statement
-void exc_E_codes()
+/* JUMP to address NNN*/
+void op_1NNN()
 {
-    switch (opcode & 0xFF)
+    uint16_t target = opcode & 0x0FFFu;
+    if (target == ((program_counter - 2) & 0xFFFu))
     {
-    case 0x9E:
-        op_Ex9E();
-        break;
-    case 0xA1:
-        op_ExA1();
-        break;
+        idle = IDLE_JUMP;
+    }
+    else if (target == ((program_counter - 6) & 0xFFFu) && is_timer_poll(target))
+    {
+        idle = IDLE_TIMER;
     }
+    program_counter = target;
 }
 
-void exc_F_codes()
+/* CALL subroutine at nnn*/
+void op_2NNN()
+{
+    // the stack wraps around instead of overflowing
+    stack[stack_pointer] = program_counter;
+    stack_pointer = (stack_pointer + 1) & 0xFu;
+    program_counter = opcode & 0x0FFFu;
+}
+
+/* Skip next instruction if Vx == kk*/
+void op_3xkk()
+{
+    uint8_t reg = (opcode & 0xF00u) >> 8u;
+    uint8_t kk = (opcode & 0xFFu);
+    if (registers[reg] == kk)
+    {
+        program_counter = (program_counter + 2) & 0xFFFu;
+    }
+}
+/* Skip next instruction if Vx = Vy. */
+
+/* Skip next instruction if Vx != kk*/
+void op_4xkk()
+{
+    uint8_t reg = (opcode & 0xF00u) >> 8u;
+    uint8_t kk = (opcode & 0xFFu);
+    if (registers[reg] != kk)
+    {
+        program_counter = (program_counter + 2) & 0xFFFu;
+    }
+}
+
+/*Skip next instruction if Vx = Vy.*/
+void op_5xy0()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t y = (opcode & 0xF0u) >> 4;
+    if (registers[x] == registers[y])
+    {
+        program_counter = (program_counter + 2) & 0xFFFu;
+    }
+}
+
+/*Set Vx == kk*/
+void op_6xkk()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t kk = (opcode & 0xFFu);
+    registers[x] = kk;
+}
+
+/*Add kk to Vx*/
+void op_7xkk()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t kk = (opcode & 0xFFu);
+    registers[x] = registers[x] + kk;
+}
+
+/*Set Vx = Vy*/
+void op_8xy0()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t y = (opcode & 0xF0u) >> 4;
+    registers[x] = registers[y];
+}
+
+/*Set Vx = Vx | Vy*/
+void op_8xy1()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t y = (opcode & 0xF0u) >> 4;
+    registers[x] |= registers[y];
+}
+
+/*Set Vx = Vx & vy*/
+void op_8xy2()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t y = (opcode & 0xF0u) >> 4;
+    registers[x] &= registers[y];
+}
+
+/*Set Vx = Vx ^ vy*/
+void op_8xy3()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t y = (opcode & 0xF0u) >> 4;
+    registers[x] ^= registers[y];
+}
+
+/*Set Vx = Vx + Vy, set VF = carry*/
+void op_8xy4()
+{
+    uint8_t x = (opcode & 0x0F00u) >> 8u;
+    uint8_t y = (opcode & 0x00F0u) >> 4u;
+    uint16_t res = registers[x] + registers[y];
+
+    if (x == 0xF)
+    {
+        registers[x] = res & 0xFFu;
+        if (res > 255)
+        {
+            registers[0xF] = 1;
+        }
+        else
+        {
+            registers[0xF] = 0;
+        }
+    }
+    else
+    {
+        if (res > 255)
+        {
+            registers[0xF] = 1;
+        }
+        else
+        {
+            registers[0xF] = 0;
+        }
+
+        registers[x] = res & 0xFFu;
+    }
+}
+
+/*
+ Set Vx = Vx - Vy, set VF = NOT borrow
+ If Vx > Vy, then VF is set to 1, otherwise 0.
+ Then Vy is subtracted from Vx, and the results stored in Vx.
+*/
+void op_8xy5()
+{
+    uint8_t x = (opcode & 0x0F00u) >> 8u;
+    uint8_t y = (opcode & 0x00F0u) >> 4u;
+
+    if (registers[x] > registers[y])
+    {
+        registers[0xF] = 1;
+    }
+    else
+    {
+        registers[0xF] = 0;
+    }
+
+    registers[x] -= registers[y];
+}
+
+/*
+ If the least-significant bit of Vx is 1,
+ then VF is set to 1, otherwise 0. Then Vx is divided by 2.
+*/
+void op_8xy6()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    if (quirks & QUIRK_SHIFT)
+    {
+        registers[x] = registers[(opcode & 0xF0u) >> 4];
+    }
+    // saving lsb int CARRY
+    if (registers[x] & 0x1)
+    {
+        registers[0xF] = 1;
+    }
+    else
+    {
+        registers[0xF] = 0;
+    }
+    registers[x] >>= 1;
+}
+
+/*  Set Vx = Vy - Vx, set VF = NOT borrow */
+void op_8xy7()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8u;
+    uint8_t y = (opcode & 0xF0u) >> 4u;
+    if (registers[y] > registers[x])
+    {
+        registers[0xF] = 1;
+    }
+    else
+    {
+        registers[0xF] = 0;
+    }
+    registers[x] = registers[y] - registers[x];
+}
+
+/*
+ If the most-significant bit of Vx is 1,
+  then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2.
+*/
+void op_8xyE()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8u;
+    if (quirks & QUIRK_SHIFT)
+    {
+        registers[x] = registers[(opcode & 0xF0u) >> 4u];
+    }
+    // saving msb into CARRY
+    registers[0xF] = (registers[x] & 0x80) >> 7u;
+    registers[x] <<= 1;
+}
+
+/*Skip next instruction if Vx != Vy*/
+void op_9xy0()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8u;
+    uint8_t y = (opcode & 0xF0u) >> 4u;
+    if (registers[x] != registers[y])
+    {
+        program_counter = (program_counter + 2) & 0xFFFu;
+    }
+}
+
+/*The value of register I is set to nnn*/
+void op_Annn()
+{
+    index_register = (opcode & 0xFFFu);
+}
+
+/*Jump to location nnn + V0*/
+void op_Bnnn()
+{
+    if (quirks & QUIRK_JUMP)
+    {
+        program_counter = ((opcode & 0xFFFu) + registers[(opcode & 0xF00u) >> 8]) & 0xFFFu;
+        return;
+    }
+    program_counter = ((opcode & 0xFFFu) + registers[0]) & 0xFFFu;
+}
+
+/* Set Vx = random byte AND kk */
+void op_Cxkk()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t kk = (opcode & 0xFFu);
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    registers[x] = (uint8_t)(rng_state >> 24) & kk;
+}
+
+/* Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision. */
+void op_Dxyn()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t y = (opcode & 0xF0u) >> 4;
+    uint8_t height = (opcode & 0xFu);
+
+    // wrap around if trying to write off screen
+    uint8_t xPos = registers[x] % SCREEN_WIDTH;
+    uint8_t yPos = registers[y] % SCREEN_HEIGHT;
+
+    // if there are no collisions the carry flag is set to 0
+    registers[0xF] = 0;
+
+    for (int i = 0; i < height; i++)
+    {
+        uint8_t spriteByte = main_mem[(index_register + i) & 0xFFFu];
+
+        // rows and columns that run off the screen wrap around to the other side
+        uint32_t *row = &video[((yPos + i) & (SCREEN_HEIGHT - 1)) * SCREEN_WIDTH];
+        for (int j = 0; j < 8; j++)
+        {
+            uint8_t spritePixel = spriteByte & (0x80u >> j);
+            uint32_t *screenPixel = &row[(xPos + j) & (SCREEN_WIDTH - 1)];
+            if (spritePixel)
+            {
+                if (*screenPixel == 0xFFFFFFFF)
+                {
+                    // if there is a collision between
+                    // what is on the screen and the sprite
+                    // we are trying to draw we set the vf flag
+                    registers[0xF] = 1;
+                }
+
+                // xor the screen
+                *screenPixel ^= 0xFFFFFFFF;
+            }
+        }
+    }
+}
+
+/* Skip next instruction if key with the value of Vx is pressed. */
+void op_Ex9E()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    if (user_keypad[registers[x] & 0xFu])
+    {
+        program_counter = (program_counter + 2) & 0xFFFu;
+    }
+}
+
+/* Skip next instruction if key with the value of Vx is not pressed. */
+void op_ExA1()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    if (!user_keypad[registers[x] & 0xFu])
+    {
+        program_counter = (program_counter + 2) & 0xFFFu;
+    }
+}
+
+/* Set Vx = delay timer value */
+void op_Fx07()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8u;
+    registers[x] = delay_timer;
+}
+
+/* Wait for a key press, store the value of the key in Vx */
+void op_Fx0A()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    for (int i = 0; i < 16; i++)
+    {
+        if (user_keypad[i])
+        {
+            // key is pressed so we can store its value in x
+            registers[x] = (uint8_t)i;
+            return;
+        }
+    }
+    // if no user_keypad are pressed we can
+    // effectively sleep by decrementing the pc by 2
+    // causing this instruction to run again next frame
+    program_counter = (program_counter - 2) & 0xFFFu;
+    idle = IDLE_KEY;
+}
+
+/* Set dealy timer = Vx */
+void op_Fx15()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    delay_timer = registers[x];
+}
+
+/* Set sound timer = Vx */
+void op_Fx18()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    sound_timer = registers[x];
+}
+
+void op_Fx1E()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    index_register += registers[x];
+}
+
+/*Set index register = location of sprite for digit Vx*/
+void op_Fx29()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    index_register = FONTSTART + (registers[x] * 5);
+}
+
+/*
+Store BCD representation of Vx in memory locations I, I+1, and I+2.
+
+The interpreter takes the decimal value of Vx,
+and places the hundreds digit in memory at location in I,
+the tens digit at location I+1, and the ones digit at location I+2.
+*/
+void op_Fx33()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    uint8_t digit = registers[x];
+    main_mem[(index_register + 2) & 0xFFFu] = (digit % 10);
+    digit /= 10;
+    main_mem[(index_register + 1) & 0xFFFu] = (digit % 10);
+    digit /= 10;
+    main_mem[index_register & 0xFFFu] = (digit % 10);
+}
+
+/* Store registers V0 through Vx in memory starting at location I */
+void op_Fx55()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    for (int i = 0; i <= x; i++)
+    {
+        main_mem[(index_register + i) & 0xFFFu] = registers[i];
+    }
+    if (quirks & QUIRK_LOADSTORE)
+    {
+        index_register += x + 1;
+    }
+}
+
+/* Read registers V0 through Vx in memory starting at location I */
+void op_Fx65()
+{
+    uint8_t x = (opcode & 0xF00u) >> 8;
+    for (int i = 0; i <= x; i++)
+    {
+        registers[i] = main_mem[(index_register + i) & 0xFFFu];
+    }
+    if (quirks & QUIRK_LOADSTORE)
+    {
+        index_register += x + 1;
+    }
+}
+
+/* Opcodes that do not exist do nothing. */
+void op_invalid()
+{
+}
+
+/* END OPCODE IMPLIMENTATIONS*/
+
+/* Set up function table for opcodes*/
+
+void (*zero_table[0x2])() = {&op_00E0, &op_00EE};
+
+void (*eight_table[0x10])();
+
+// indexed by the whole low byte so no opcode can read past the end
+void (*F_table[0x100])();
+
+void setup_functables()
+{
+    for (int i = 0; i < 0x10; i++)
+        eight_table[i] = &op_invalid;
+    for (int i = 0; i < 0x100; i++)
+        F_table[i] = &op_invalid;
+    eight_table[0x0] = &op_8xy0,
+    eight_table[0x1] = &op_8xy1,
+    eight_table[0x2] = &op_8xy2,
+    eight_table[0x3] = &op_8xy3,
+    eight_table[0x4] = &op_8xy4,
+    eight_table[0x5] = &op_8xy5,
+    eight_table[0x6] = &op_8xy6,
+    eight_table[0x7] = &op_8xy7,
+    eight_table[0xE] = &op_8xyE,
+    F_table[0x07] = &op_Fx07;
+    F_table[0x0A] = &op_Fx0A;
+    F_table[0x15] = &op_Fx15;
+    F_table[0x18] = &op_Fx18;
+    F_table[0x1E] = &op_Fx1E;
+    F_table[0x29] = &op_Fx29;
+    F_table[0x33] = &op_Fx33;
+    F_table[0x55] = &op_Fx55;
+    F_table[0x65] = &op_Fx65;
+
+}
+
+void exc_zero_codes()
+{
+    (*zero_table[(opcode >> 1) & 0x1])();
+}
+
+void exc_eight_codes()
+{
+    (*eight_table[opcode & 0xF])();
+}
+
+// no table for E codes just a simple switch statement
+void exc_E_codes()
+{
+    switch (opcode & 0xFF)
+    {
+    case 0x9E:
+        op_Ex9E();
+        break;
+    case 0xA1:
+        op_ExA1();
+        break;
+    }
+}
+
+void exc_F_codes()
 {
     (*F_table[opcode & 0xFF])();
 }
 
 
 
-// main function table is directed by the msb
-void (*main_table[0x10])() = {
-    &exc_zero_codes,
-    &op_1NNN,
-    &op_2NNN,
-    &op_3xkk,
-    &op_4xkk,
-    &op_5xy0,
-    &op_6xkk,
-    &op_7xkk,
-    &exc_eight_codes,
-    &op_9xy0,
-    &op_Annn,
-    &op_Bnnn,
-    &op_Cxkk,
-    &op_Dxyn,
-    &exc_E_codes,
-    &exc_F_codes
+// main function table is directed by the msb
+void (*main_table[0x10])() = {
+    &exc_zero_codes,
+    &op_1NNN,
+    &op_2NNN,
+    &op_3xkk,
+    &op_4xkk,
+    &op_5xy0,
+    &op_6xkk,
+    &op_7xkk,
+    &exc_eight_codes,
+    &op_9xy0,
+    &op_Annn,
+    &op_Bnnn,
+    &op_Cxkk,
+    &op_Dxyn,
+    &exc_E_codes,
+    &exc_F_codes
+};
+
+/*
+    represents 1 cpu cycle
+    grab opcode from program counter
+    increase program counter by 2
+    execute the instruction represented by the opcode
+
+*/
+void cycle()
+{
+    opcode = (main_mem[program_counter & 0xFFFu] << 8) | main_mem[(program_counter + 1) & 0xFFFu];
+    program_counter = (program_counter + 2) & 0xFFFu;
+
+    // execute the opcode
+    (*main_table[(opcode & 0xF000) >> 12])();
+}
+
+/* the delay and sound timers count down once per frame */
+void tick_timers()
+{
+    if (delay_timer >= 1)
+    {
+        delay_timer--;
+    }
+    if (sound_timer >= 1)
+    {
+        sound_timer--;
+    }
+}
+
+/*
+    Run one frame worth of instructions then tick the timers.
+    The frame ends early once the rom goes idle since the
+    remaining instructions would only spin in place.
+    Returns the number of instructions executed
+*/
+uint32_t run_frame()
+{
+    idle = IDLE_NONE;
+    uint32_t i = 0;
+    for (; i < ipf && !idle; i++)
+    {
+        cycle();
+    }
+    tick_timers();
+    return i;
+}
+
+/* VIP TIMING */
+
+/*
+    With the vip quirk a frame is not a fixed number of instructions but
+    the machine cycles (8 clocks of the 1.76 MHz 1802) the COSMAC VIP has
+    between two display interrupts, each instruction costing about what
+    it did in the original interpreter. Timers tick and the display is
+    shown per emulated frame so nothing depends on wall time
+*/
+
+// 1760640 clocks a second / 8 clocks per machine cycle / 60 frames
+const int32_t VIP_FRAME_CYCLES = 3668;
+
+// the display dma and interrupt routine take this much of every frame
+const int32_t VIP_DISPLAY_CYCLES = 1070;
+
+// machine cycles per instruction group, the 0, D and F groups are costed by vip_cost
+const uint16_t vip_cycles[0x10] = {23, 23, 23, 12, 12, 16, 6, 10, 44, 16, 12, 23, 36, 0, 16, 0};
+
+/* Machine cycles op takes on the VIP */
+uint32_t vip_cost(uint16_t op)
+{
+    switch (op >> 12)
+    {
+    case 0x0:
+        // clearing the screen touches all 256 bytes of display memory
+        return op == 0x00E0u ? 24 + 256 / 2 : vip_cycles[0x0];
+    case 0xD:
+        // about 70 cycles a sprite row, shifted into two bytes
+        return 26 + 70 * (op & 0xFu);
+    case 0xF:
+        switch (op & 0xFFu)
+        {
+        case 0x1E:
+            return 19;
+        case 0x29:
+            return 20;
+        case 0x33:
+            return 204;
+        case 0x55:
+        case 0x65:
+            return 14 + 14 * ((op & 0xF00u) >> 8);
+        default:
+            return 10;
+        }
+    default:
+        return vip_cycles[op >> 12];
+    }
+}
+
+/* Run one VIP frame of instructions then tick the timers */
+uint32_t vip_frame()
+{
+    idle = IDLE_NONE;
+    vip_clock += VIP_FRAME_CYCLES - VIP_DISPLAY_CYCLES;
+    uint32_t i = 0;
+    while (vip_clock > 0 && !idle)
+    {
+        opcode = (main_mem[program_counter & 0xFFFu] << 8) | main_mem[(program_counter + 1) & 0xFFFu];
+        program_counter = (program_counter + 2) & 0xFFFu;
+        vip_clock -= vip_cost(opcode);
+        (*main_table[(opcode & 0xF000) >> 12])();
+        i++;
+
+        // a drawn sprite only shows after the next interrupt so the interpreter waits for it
+        if ((opcode >> 12) == 0xD)
+        {
+            break;
+        }
+    }
+
+    // waiting for vblank or spinning idle uses up the rest of the frame
+    if (vip_clock > 0)
+    {
+        vip_clock = 0;
+    }
+    tick_timers();
+    return i;
+}
+
+/* END VIP TIMING */
+
+/* EXECUTION TRACE */
+
+/*
+    A trace records every executed instruction in a compact binary form.
+    After a header (magic, rom hash) each instruction is a flags byte
+    followed only by what changed since the previous instruction:
+
+    TRACE_PC    2 bytes     pc, when it is not the previous pc + 2
+    TRACE_OP    2 bytes     opcode, when it differs from the last one seen at pc
+    TRACE_REG   2 bytes     register index and value, when one register changed
+    TRACE_REGS  2 bytes     mask of changed registers followed by a byte for each,
+                            when more than one changed
+    TRACE_I     2 bytes     index register, when it changed
+
+    A lone TRACE_FRAME byte marks the end of each frame. Values are big endian
+*/
+
+const char TRACE_MAGIC[8] = "C8TRACE1";
+const uint8_t TRACE_PC = 0x01;
+const uint8_t TRACE_OP = 0x02;
+const uint8_t TRACE_REG = 0x04;
+const uint8_t TRACE_REGS = 0x08;
+const uint8_t TRACE_I = 0x10;
+const uint8_t TRACE_FRAME = 0x80;
+
+// the trace is filled into one of several buffers and a background
+// thread writes full buffers out so tracing never waits on the disk
+const int TRACE_BUFFERS = 4;
+const size_t TRACE_BUFFER_SIZE = 1 << 16;
+
+FILE *trace_file = NULL;
+uint8_t trace_buffers[4][1 << 16];
+size_t trace_fill[4];
+int trace_head = 0;
+int trace_tail = 0;
+int trace_queued = 0;
+uint8_t trace_done = 0x0;
+pthread_t trace_thread;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+
+// state the next record is encoded against
+uint16_t trace_next_pc = 0x0;
+uint32_t trace_opcodes[0x1000];
+
+/* write queued buffers out until the trace is closed */
+void *trace_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&trace_lock);
+    for (;;)
+    {
+        while (!trace_queued && !trace_done)
+        {
+            pthread_cond_wait(&trace_cond, &trace_lock);
+        }
+        if (!trace_queued)
+        {
+            break;
+        }
+
+        int buffer = trace_tail;
+        pthread_mutex_unlock(&trace_lock);
+        fwrite(trace_buffers[buffer], 1, trace_fill[buffer], trace_file);
+        pthread_mutex_lock(&trace_lock);
+
+        trace_tail = (trace_tail + 1) % TRACE_BUFFERS;
+        trace_queued--;
+        pthread_cond_broadcast(&trace_cond);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+/* hand the current buffer to the writer and move on to the next free one */
+void trace_submit()
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_queued++;
+    pthread_cond_broadcast(&trace_cond);
+    while (trace_queued == TRACE_BUFFERS)
+    {
+        pthread_cond_wait(&trace_cond, &trace_lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_head = (trace_head + 1) % TRACE_BUFFERS;
+    trace_fill[trace_head] = 0;
+}
+
+/* make room for a record of up to 24 bytes and return where it goes */
+uint8_t *trace_reserve()
+{
+    if (trace_fill[trace_head] + 24 > TRACE_BUFFER_SIZE)
+    {
+        trace_submit();
+    }
+    return &trace_buffers[trace_head][trace_fill[trace_head]];
+}
+
+void trace_open(char *filename)
+{
+    trace_file = fopen(filename, "wb");
+    if (!trace_file)
+    {
+        printf("Could not write trace %s\n", filename);
+        exit(1);
+    }
+
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), trace_file);
+    uint8_t hash[8];
+    for (int i = 0; i < 8; i++)
+    {
+        hash[i] = rom_hash >> (56 - i * 8);
+    }
+    fwrite(hash, 1, sizeof(hash), trace_file);
+
+    trace_next_pc = program_counter;
+    memset(trace_opcodes, 0xFF, sizeof(trace_opcodes));
+    pthread_create(&trace_thread, NULL, trace_writer, NULL);
+}
+
+void trace_close()
+{
+    if (!trace_file)
+    {
+        return;
+    }
+    if (trace_fill[trace_head])
+    {
+        trace_submit();
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_done = 0x1;
+    pthread_cond_broadcast(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_join(trace_thread, NULL);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+/* execute one instruction and record it */
+void trace_cycle()
+{
+    uint64_t before[2], after[2];
+    memcpy(before, registers, sizeof(before));
+    uint16_t index_before = index_register;
+    uint16_t pc = program_counter;
+
+    cycle();
+
+    uint8_t *record = trace_reserve();
+    uint8_t *out = record + 1;
+    uint8_t flags = 0x0;
+
+    if (pc != trace_next_pc)
+    {
+        flags |= TRACE_PC;
+        *out++ = pc >> 8;
+        *out++ = pc & 0xFFu;
+    }
+    trace_next_pc = pc + 2;
+
+    if (trace_opcodes[pc & 0xFFFu] != opcode)
+    {
+        trace_opcodes[pc & 0xFFFu] = opcode;
+        flags |= TRACE_OP;
+        *out++ = opcode >> 8;
+        *out++ = opcode & 0xFFu;
+    }
+
+    // registers are compared 8 at a time and only the changed bytes are looked at
+    memcpy(after, registers, sizeof(after));
+    uint16_t mask = 0x0;
+    for (int w = 0; w < 2; w++)
+    {
+        uint64_t diff = before[w] ^ after[w];
+        while (diff)
+        {
+            int byte = __builtin_ctzll(diff) >> 3;
+            diff &= ~(0xFFull << (byte * 8));
+            if (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+            {
+                byte = 7 - byte;
+            }
+            mask |= 1u << (w * 8 + byte);
+        }
+    }
+
+    if (mask && !(mask & (mask - 1)))
+    {
+        int changed = __builtin_ctz(mask);
+        flags |= TRACE_REG;
+        *out++ = changed;
+        *out++ = registers[changed];
+    }
+    else if (mask)
+    {
+        flags |= TRACE_REGS;
+        *out++ = mask >> 8;
+        *out++ = mask & 0xFFu;
+        for (int i = 0; i < 0x10; i++)
+        {
+            if (mask & (1u << i))
+            {
+                *out++ = registers[i];
+            }
+        }
+    }
+
+    if (index_register != index_before)
+    {
+        flags |= TRACE_I;
+        *out++ = index_register >> 8;
+        *out++ = index_register & 0xFFu;
+    }
+
+    record[0] = flags;
+    trace_fill[trace_head] += out - record;
+}
+
+/* mark the end of a frame in the trace */
+void trace_frame_end()
+{
+    *trace_reserve() = TRACE_FRAME;
+    trace_fill[trace_head]++;
+}
+
+/* the tracing core, a copy of run_frame() that records every instruction */
+uint32_t trace_frame()
+{
+    idle = IDLE_NONE;
+    uint32_t i = 0;
+    for (; i < ipf && !idle; i++)
+    {
+        trace_cycle();
+    }
+    tick_timers();
+    trace_frame_end();
+    return i;
+}
+
+/* one decoded trace record */
+struct trace_record
+{
+    uint32_t frame;
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t changed;
+    uint8_t registers[0x10];
+    uint16_t index_register;
+};
+
+/*
+    Decode a trace, calling visit for every instruction.
+    Returns the number of instructions or -1 if the file is not a trace
+*/
+long decode_trace(char *filename, void (*visit)(struct trace_record *, void *), void *arg)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TRACE_MAGIC) + 8)
+    {
+        printf("Could not read trace %s\n", filename);
+        return -1;
+    }
+
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED || memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)))
+    {
+        printf("Bad trace %s\n", filename);
+        return -1;
+    }
+
+    static uint32_t opcodes[0x1000];
+    memset(opcodes, 0, sizeof(opcodes));
+    struct trace_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.pc = PROGSTART - 2;
+
+    const uint8_t *p = data + sizeof(TRACE_MAGIC) + 8;
+    const uint8_t *end = data + st.st_size;
+    long count = 0;
+
+    while (p < end)
+    {
+        uint8_t flags = *p++;
+        if (flags == TRACE_FRAME)
+        {
+            rec.frame++;
+            continue;
+        }
+
+        // stop at a record cut short by the end of the file
+        size_t need = ((flags & TRACE_PC) ? 2 : 0) + ((flags & TRACE_OP) ? 2 : 0) +
+                      ((flags & (TRACE_REG | TRACE_REGS)) ? 2 : 0) + ((flags & TRACE_I) ? 2 : 0);
+        if ((size_t)(end - p) < need)
+        {
+            break;
+        }
+        if (flags & TRACE_REGS)
+        {
+            const uint8_t *mask = p + need - ((flags & TRACE_I) ? 4 : 2);
+            need += __builtin_popcount((mask[0] << 8) | mask[1]);
+            if ((size_t)(end - p) < need)
+            {
+                break;
+            }
+        }
+
+        rec.pc = (flags & TRACE_PC) ? (p[0] << 8) | p[1] : rec.pc + 2;
+        p += (flags & TRACE_PC) ? 2 : 0;
+
+        if (flags & TRACE_OP)
+        {
+            opcodes[rec.pc & 0xFFFu] = (p[0] << 8) | p[1];
+            p += 2;
+        }
+        rec.opcode = opcodes[rec.pc & 0xFFFu];
+
+        rec.changed = 0x0;
+        if (flags & TRACE_REG)
+        {
+            rec.changed = 1u << (p[0] & 0xFu);
+            rec.registers[p[0] & 0xFu] = p[1];
+            p += 2;
+        }
+        if (flags & TRACE_REGS)
+        {
+            rec.changed = (p[0] << 8) | p[1];
+            p += 2;
+            for (int i = 0; i < 0x10; i++)
+            {
+                if (rec.changed & (1u << i))
+                {
+                    rec.registers[i] = *p++;
+                }
+            }
+        }
+        if (flags & TRACE_I)
+        {
+            rec.index_register = (p[0] << 8) | p[1];
+            p += 2;
+        }
+
+        visit(&rec, arg);
+        count++;
+    }
+
+    munmap((void *)data, st.st_size);
+    return count;
+}
+
+/* print a record as text, arg points at the lo and hi pc to show */
+void print_record(struct trace_record *rec, void *arg)
+{
+    uint16_t *range = arg;
+    if (rec->pc < range[0] || rec->pc > range[1])
+    {
+        return;
+    }
+
+    char text[24];
+    disassemble(rec->opcode, text, sizeof(text));
+    printf("%6u %03x %04x %-14s", rec->frame, rec->pc, rec->opcode, text);
+    for (int i = 0; i < 0x10; i++)
+    {
+        if (rec->changed & (1u << i))
+        {
+            printf(" V%X=%02x", i, rec->registers[i]);
+        }
+    }
+    printf(" I=%03x\n", rec->index_register);
+}
+
+/* Dump a trace as text, optionally only for pcs between lo and hi */
+int dump_trace(char *filename, char **args, int count)
+{
+    uint16_t range[2] = {0x0, 0xFFF};
+    if (count == 2)
+    {
+        range[0] = strtoul(args[0], NULL, 16);
+        range[1] = strtoul(args[1], NULL, 16);
+    }
+    return decode_trace(filename, print_record, range) < 0;
+}
+
+// counts collected while summarizing a trace
+struct trace_summary
+{
+    uint32_t hits[0x1000];
+    uint16_t last_pc;
+    uint16_t last_op;
+    uint8_t started;
+
+    // backward jumps, keyed by their source and target
+    struct
+    {
+        uint16_t from, to;
+        uint32_t count;
+    } loops[1024];
+    int loop_count;
+
+    // calls between subroutines, keyed by caller and callee entry points
+    struct
+    {
+        uint16_t caller, callee;
+        uint32_t count;
+    } calls[1024];
+    int call_count;
+
+    uint16_t call_stack[64];
+    int depth;
+};
+
+void summarize_record(struct trace_record *rec, void *arg)
+{
+    struct trace_summary *sum = arg;
+    sum->hits[rec->pc & 0xFFFu]++;
+
+    // a transfer to the same or an earlier address closes a loop
+    if (sum->started && rec->pc <= sum->last_pc && sum->last_op != 0x00EE && (sum->last_op & 0xF000u) != 0x2000u)
+    {
+        int i = 0;
+        while (i < sum->loop_count && (sum->loops[i].from != sum->last_pc || sum->loops[i].to != rec->pc))
+        {
+            i++;
+        }
+        if (i == sum->loop_count && sum->loop_count < 1024)
+        {
+            sum->loops[sum->loop_count].from = sum->last_pc;
+            sum->loops[sum->loop_count].to = rec->pc;
+            sum->loops[sum->loop_count++].count = 0;
+        }
+        if (i < sum->loop_count)
+        {
+            sum->loops[i].count++;
+        }
+    }
+
+    if ((rec->opcode & 0xF000u) == 0x2000u)
+    {
+        uint16_t caller = sum->depth ? sum->call_stack[sum->depth - 1] : PROGSTART;
+        uint16_t callee = rec->opcode & 0xFFFu;
+
+        int i = 0;
+        while (i < sum->call_count && (sum->calls[i].caller != caller || sum->calls[i].callee != callee))
+        {
+            i++;
+        }
+        if (i == sum->call_count && sum->call_count < 1024)
+        {
+            sum->calls[sum->call_count].caller = caller;
+            sum->calls[sum->call_count].callee = callee;
+            sum->calls[sum->call_count++].count = 0;
+        }
+        if (i < sum->call_count)
+        {
+            sum->calls[i].count++;
+        }
+
+        if (sum->depth < 64)
+        {
+            sum->call_stack[sum->depth++] = callee;
+        }
+    }
+    else if (rec->opcode == 0x00EE && sum->depth > 0)
+    {
+        sum->depth--;
+    }
+
+    sum->last_pc = rec->pc;
+    sum->last_op = rec->opcode;
+    sum->started = 1;
+}
+
+/* Print the hottest addresses, the busiest loops and the call graph of a trace */
+int summarize_trace(char *filename)
+{
+    struct trace_summary *sum = calloc(1, sizeof(struct trace_summary));
+    if (!sum)
+    {
+        printf("Out of memory summarizing trace\n");
+        return 1;
+    }
+
+    long count = decode_trace(filename, summarize_record, sum);
+    if (count < 0)
+    {
+        free(sum);
+        return 1;
+    }
+    printf("%ld instructions\n\nhottest addresses\n", count);
+
+    // pick the top ten of each table by repeatedly taking the largest
+    for (int n = 0; n < 10; n++)
+    {
+        int best = 0;
+        for (int i = 1; i < 0x1000; i++)
+        {
+            if (sum->hits[i] > sum->hits[best])
+                best = i;
+        }
+        if (!sum->hits[best])
+            break;
+        printf("  %03x %10u\n", best, sum->hits[best]);
+        sum->hits[best] = 0;
+    }
+
+    printf("\nbusiest loops\n");
+    for (int n = 0; n < 10; n++)
+    {
+        int best = -1;
+        for (int i = 0; i < sum->loop_count; i++)
+        {
+            if (sum->loops[i].count && (best < 0 || sum->loops[i].count > sum->loops[best].count))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        printf("  %03x-%03x %10u\n", sum->loops[best].to, sum->loops[best].from, sum->loops[best].count);
+        sum->loops[best].count = 0;
+    }
+
+    printf("\ncall graph\n");
+    for (int i = 0; i < sum->call_count; i++)
+    {
+        printf("  %03x -> %03x %10u\n", sum->calls[i].caller, sum->calls[i].callee, sum->calls[i].count);
+    }
+
+    free(sum);
+    return 0;
+}
+
+/* END EXECUTION TRACE */
+
+#ifdef CHIP8_AOT
+
+/* AOT RUNTIME */
+
+/*
+    Built with -DCHIP8_AOT and linked with a translation unit made by -C.
+    The translated rom runs as native code and the interpreter takes over
+    wherever there is no translated code: computed jumps, code outside
+    the rom and blocks whose code has been overwritten
+*/
+
+extern const uint64_t aot_rom_hash;
+extern const uint8_t aot_rom[];
+extern const size_t aot_rom_size;
+
+// block holding each translated byte, -1 for bytes with no translated code
+extern const int16_t aot_block_of[0x1000];
+
+// set once a block's code has been written to, so it is left to the interpreter
+extern const size_t aot_blocks;
+extern uint8_t aot_dirty[];
+
+/* run translated code from the program counter for up to budget instructions, 0 if there is none */
+uint32_t aot_run(uint32_t budget);
+
+/* Mark the blocks a store of len bytes at addr overwrites, returns 1 if it hits translated code */
+int aot_store(uint16_t addr, uint16_t len)
+{
+    int hit = 0;
+    for (uint16_t i = 0; i < len; i++)
+    {
+        int16_t block = aot_block_of[(addr + i) & 0xFFFu];
+        if (block >= 0)
+        {
+            aot_dirty[block] = 0x1;
+            hit = 1;
+        }
+    }
+    return hit;
+}
+
+/* Hand every block back to the translated code, for when the rom is restarted */
+void aot_reset()
+{
+    memset(aot_dirty, 0, aot_blocks);
+}
+
+/* Interpret one instruction, marking any translated code it is about to overwrite */
+void aot_cycle()
+{
+    uint16_t op = (main_mem[program_counter & 0xFFFu] << 8) | main_mem[(program_counter + 1) & 0xFFFu];
+    if ((op & 0xF0FFu) == 0xF033u)
+    {
+        aot_store(index_register, 3);
+    }
+    else if ((op & 0xF0FFu) == 0xF055u)
+    {
+        aot_store(index_register, ((op & 0xF00u) >> 8) + 1);
+    }
+    cycle();
+}
+
+/* the translated core, runs a frame in native code falling back to aot_cycle() where there is none */
+uint32_t aot_frame()
+{
+    idle = IDLE_NONE;
+    uint32_t i = 0;
+    while (i < ipf && !idle)
+    {
+        uint32_t n = aot_run(ipf - i);
+        if (n == 0)
+        {
+            aot_cycle();
+            n = 1;
+        }
+        i += n;
+    }
+    tick_timers();
+    return i;
+}
+
+/* END AOT RUNTIME */
+
+#endif
+
+/* DEBUGGER */
+
+/*
+    Run one instruction for the debugger, recording it when a trace is
+    being written. The translated build has to see the stores made while
+    debugging, or the translated core would run stale code once the
+    debugger hands the frames back to it
+*/
+void debug_cycle()
+{
+    if (trace_file)
+    {
+        trace_cycle();
+        return;
+    }
+#ifdef CHIP8_AOT
+    aot_cycle();
+#else
+    cycle();
+#endif
+}
+
+/* Address of a watchpoint the instruction at the program counter is about to write, -1 if none */
+int watched_write()
+{
+    uint16_t op = (main_mem[program_counter & 0xFFFu] << 8) | main_mem[(program_counter + 1) & 0xFFFu];
+    uint16_t span;
+
+    if ((op & 0xF0FFu) == 0xF033u)
+    {
+        span = 2;
+    }
+    else if ((op & 0xF0FFu) == 0xF055u)
+    {
+        span = (op & 0xF00u) >> 8;
+    }
+    else
+    {
+        return -1;
+    }
+
+    // stores wrap around the end of memory like the opcodes do
+    for (int i = 0; i < watchpoint_count; i++)
+    {
+        if (((watchpoints[i] - index_register) & 0xFFFu) <= span)
+        {
+            return watchpoints[i];
+        }
+    }
+    return -1;
+}
+
+/* Index of a register condition that has just become true, -1 if none */
+int triggered_condition()
+{
+    int triggered = -1;
+    for (int i = 0; i < condition_count; i++)
+    {
+        struct condition *c = &conditions[i];
+        uint16_t value = c->reg == 0x10 ? index_register : registers[c->reg];
+        uint8_t is_true = 0;
+
+        switch (c->op)
+        {
+        case '=':
+            is_true = value == c->value;
+            break;
+        case '!':
+            is_true = value != c->value;
+            break;
+        case '<':
+            is_true = value < c->value;
+            break;
+        case '>':
+            is_true = value > c->value;
+            break;
+        }
+
+        if (is_true && !c->was_true)
+        {
+            triggered = i;
+        }
+        c->was_true = is_true;
+    }
+    return triggered;
+}
+
+/*
+    The checking core, a copy of run_frame() that stops on breakpoints,
+    watchpoints, register conditions and the end of a step over or step out.
+    A frame interrupted by the debugger does not tick the timers
+*/
+uint32_t debug_frame()
+{
+    idle = IDLE_NONE;
+    uint32_t i = 0;
+    for (; i < ipf && !idle; i++)
+    {
+        if (!resuming && is_breakpoint(program_counter))
+        {
+            prog_pause = 0x1;
+            snprintf(debug_message, sizeof(debug_message), "breakpoint at %03x", program_counter);
+            return i;
+        }
+        resuming = 0x0;
+
+        uint16_t pc = program_counter;
+        int watched = watched_write();
+
+        debug_cycle();
+
+        int cond = triggered_condition();
+        if (watched >= 0)
+        {
+            prog_pause = 0x1;
+            snprintf(debug_message, sizeof(debug_message), "watchpoint %03x written at %03x", watched, pc);
+        }
+        else if (cond >= 0)
+        {
+            prog_pause = 0x1;
+            snprintf(debug_message, sizeof(debug_message), "condition %d true at %03x", cond, pc);
+        }
+        else if (step_depth == stack_pointer && step_pc == program_counter)
+        {
+            prog_pause = 0x1;
+            snprintf(debug_message, sizeof(debug_message), "step done at %03x", program_counter);
+        }
+
+        if (prog_pause)
+        {
+            step_depth = -1;
+            return i + 1;
+        }
+    }
+    tick_timers();
+    if (trace_file)
+    {
+        trace_frame_end();
+    }
+    return i;
+}
+
+// the core used to run each frame, the checking and tracing cores are only
+// swapped in while the debugger has something to check or a trace is recorded
+uint32_t (*frame_core)() = &run_frame;
+
+void select_core()
+{
+    if (breakpoint_count || watchpoint_count || condition_count || step_depth >= 0)
+    {
+        frame_core = &debug_frame;
+    }
+    else if (trace_file)
+    {
+        frame_core = &trace_frame;
+    }
+    else if (quirks & QUIRK_VIP)
+    {
+        frame_core = &vip_frame;
+    }
+#ifdef CHIP8_AOT
+    else if (rom_hash == aot_rom_hash)
+    {
+        frame_core = &aot_frame;
+    }
+#endif
+    else
+    {
+        frame_core = &run_frame;
+    }
+}
+
+/* Add addr to a list of breakpoints or watchpoints, or remove it if it is already there */
+void toggle_address(uint16_t *list, uint8_t *count, uint16_t addr, const char *what)
+{
+    for (int i = 0; i < *count; i++)
+    {
+        if (list[i] == addr)
+        {
+            list[i] = list[--(*count)];
+            snprintf(debug_message, sizeof(debug_message), "%s at %03x removed", what, addr);
+            return;
+        }
+    }
+
+    if (*count == 16)
+    {
+        snprintf(debug_message, sizeof(debug_message), "too many %ss", what);
+        return;
+    }
+    list[(*count)++] = addr;
+    snprintf(debug_message, sizeof(debug_message), "%s at %03x set", what, addr);
+}
+
+/* Run a debugger command typed while paused */
+void debug_execute(char *cmd)
+{
+    unsigned int addr;
+    char reg[4], op[3];
+    debug_message[0] = '\0';
+
+    if (!strcmp(cmd, "s"))
+    {
+        debug_cycle();
+    }
+    else if (!strcmp(cmd, "n") || !strcmp(cmd, "o"))
+    {
+        uint16_t next = (main_mem[program_counter & 0xFFFu] << 8) | main_mem[(program_counter + 1) & 0xFFFu];
+        if (cmd[0] == 'n' && (next & 0xF000u) == 0x2000u)
+        {
+            // run the whole subroutine and stop on the instruction after the call
+            step_depth = stack_pointer;
+            step_pc = (program_counter + 2) & 0xFFFu;
+        }
+        else if (cmd[0] == 'o' && stack_pointer > 0)
+        {
+            // run until the current subroutine returns
+            step_depth = stack_pointer - 1;
+            step_pc = stack[(stack_pointer - 1) & 0xFu];
+        }
+        else if (cmd[0] == 'o')
+        {
+            snprintf(debug_message, sizeof(debug_message), "not in a subroutine");
+            return;
+        }
+        else
+        {
+            debug_cycle();
+            return;
+        }
+        prog_pause = 0x0;
+        resuming = 0x1;
+    }
+    else if (!strcmp(cmd, "c"))
+    {
+        prog_pause = 0x0;
+        resuming = 0x1;
+    }
+    else if (sscanf(cmd, "b %x", &addr) == 1)
+    {
+        toggle_address(breakpoints, &breakpoint_count, addr & 0xFFFu, "breakpoint");
+    }
+    else if (sscanf(cmd, "w %x", &addr) == 1)
+    {
+        toggle_address(watchpoints, &watchpoint_count, addr & 0xFFFu, "watchpoint");
+    }
+    else if (sscanf(cmd, "r %3s %2s %x", reg, op, &addr) == 3 && strchr("=!<>", op[0]) &&
+             (reg[0] == 'i' || (reg[0] == 'v' && strchr("0123456789abcdef", reg[1]) && reg[1])))
+    {
+        if (condition_count == 8)
+        {
+            snprintf(debug_message, sizeof(debug_message), "too many conditions");
+            return;
+        }
+        struct condition *c = &conditions[condition_count++];
+        c->reg = reg[0] == 'i' ? 0x10 : (uint8_t)strtoul(&reg[1], NULL, 16);
+        c->op = op[0];
+        c->value = addr;
+        c->was_true = 0;
+        snprintf(debug_message, sizeof(debug_message), "condition %d set", condition_count - 1);
+    }
+    else if (!strcmp(cmd, "r"))
+    {
+        condition_count = 0;
+        snprintf(debug_message, sizeof(debug_message), "conditions cleared");
+    }
+    else
+    {
+        snprintf(debug_message, sizeof(debug_message), "s n o c | b addr | w addr | r v0-vf/i ==,!=,<,> val");
+    }
+
+    select_core();
+}
+
+/* Read debugger commands from the terminal without blocking the window */
+void debug_input()
+{
+    int ch;
+    size_t len = strlen(debug_command);
+    int changed = 0;
+
+    t_init();
+
+    while ((ch = getch()) != ERR)
+    {
+        changed = 1;
+        if (ch == '\n' || ch == '\r')
+        {
+            debug_execute(debug_command);
+            debug_command[0] = '\0';
+            len = 0;
+        }
+        else if ((ch == KEY_BACKSPACE || ch == 127 || ch == 8) && len > 0)
+        {
+            debug_command[--len] = '\0';
+        }
+        else if (ch >= ' ' && ch < 127 && len < sizeof(debug_command) - 1)
+        {
+            debug_command[len++] = (char)ch;
+            debug_command[len] = '\0';
+        }
+    }
+
+    if (changed)
+    {
+        print_state();
+    }
+}
+
+/* END DEBUGGER */
+
+/* ROM ANALYSIS */
+
+/*
+    Static analysis of the loaded rom. Code is found by following every
+    jump, call and skip from PROGSTART, and the index register is tracked
+    through each run of code so sprites drawn with Annn/Dxyn and memory read
+    or written through I can be told apart from instructions
+*/
+
+const uint8_t MEM_CODE = 0x01;    // first byte of a reachable instruction
+const uint8_t MEM_BLOCK = 0x02;   // first instruction of a basic block
+const uint8_t MEM_CALLED = 0x04;  // entry point of a subroutine
+const uint8_t MEM_SPRITE = 0x08;  // drawn by Dxyn
+const uint8_t MEM_READ = 0x10;    // read by Fx65
+const uint8_t MEM_WRITTEN = 0x20; // written by Fx33 or Fx55
+const uint8_t MEM_OPERAND = 0x40; // second byte of a reachable instruction
+
+uint8_t mem_kind[0x1000];
+
+// writes through I with a known address, checked against the code once it is all found
+struct analysis_write
+{
+    uint16_t pc;
+    uint16_t lo;
+    uint16_t hi;
+};
+
+struct analysis_write analysis_writes[256];
+int analysis_write_count = 0;
+
+// set when the rom has a Bnnn jump whose targets cannot be followed
+uint8_t analysis_computed_jump = 0x0;
+
+/* mark len bytes of memory starting at addr, wrapping at the end of memory like the opcodes do */
+void mark_memory(uint16_t addr, int len, uint8_t kind)
+{
+    for (int i = 0; i < len; i++)
+    {
+        mem_kind[(addr + i) & 0xFFFu] |= kind;
+    }
+}
+
+/*
+    Successors of the instruction at pc that end its basic block.
+    Returns the number written to next, or -1 if the instruction does not end a block
+*/
+int block_successors(uint16_t pc, uint16_t op, uint16_t next[2])
+{
+    switch (op >> 12)
+    {
+    case 0x0:
+        return op == 0x00EE ? 0 : -1;
+    case 0x1:
+        next[0] = op & 0xFFFu;
+        return 1;
+    case 0x2:
+        next[0] = op & 0xFFFu;
+        next[1] = pc + 2;
+        return 2;
+    case 0x3:
+    case 0x4:
+    case 0x5:
+    case 0x9:
+        next[0] = pc + 2;
+        next[1] = pc + 4;
+        return 2;
+    case 0xB:
+        return 0;
+    case 0xE:
+        if ((op & 0xFFu) == 0x9E || (op & 0xFFu) == 0xA1)
+        {
+            next[0] = pc + 2;
+            next[1] = pc + 4;
+            return 2;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+/* Find the code, data and basic blocks of the rom loaded in main_mem */
+void analyze_rom()
+{
+    memset(mem_kind, 0, sizeof(mem_kind));
+    analysis_write_count = 0;
+    analysis_computed_jump = 0x0;
+
+    uint16_t work[0x2000];
+    int pending = 0;
+    work[pending++] = PROGSTART;
+    mem_kind[PROGSTART] |= MEM_BLOCK;
+
+    while (pending)
+    {
+        uint16_t pc = work[--pending];
+
+        // the index register is only known inside a straight run of code
+        int index_known = 0;
+        uint16_t index = 0x0;
+
+        while (pc < 0xFFE)
+        {
+            // running into code found earlier joins that block
+            if (mem_kind[pc] & MEM_CODE)
+            {
+                mem_kind[pc] |= MEM_BLOCK;
+                break;
+            }
+
+            uint16_t op = (main_mem[pc] << 8) | main_mem[pc + 1];
+            char text[24];
+            if (!disassemble(op, text, sizeof(text)))
+            {
+                break;
+            }
+
+            mem_kind[pc] |= MEM_CODE;
+            mem_kind[pc + 1] |= MEM_OPERAND;
+
+            uint8_t x = (op & 0xF00u) >> 8;
+            uint8_t kk = op & 0xFFu;
+            switch (op >> 12)
+            {
+            case 0xA:
+                index_known = 1;
+                index = op & 0xFFFu;
+                break;
+            case 0xB:
+                analysis_computed_jump = 0x1;
+                break;
+            case 0xD:
+                if (index_known)
+                {
+                    mark_memory(index, op & 0xFu, MEM_SPRITE);
+                }
+                break;
+            case 0xF:
+                if (kk == 0x1E || kk == 0x29)
+                {
+                    index_known = 0;
+                }
+                else if (kk == 0x65 && index_known)
+                {
+                    mark_memory(index, x + 1, MEM_READ);
+                }
+                else if ((kk == 0x33 || kk == 0x55) && index_known)
+                {
+                    uint16_t len = kk == 0x33 ? 3 : x + 1;
+                    mark_memory(index, len, MEM_WRITTEN);
+                    if (analysis_write_count < 256)
+                    {
+                        struct analysis_write *w = &analysis_writes[analysis_write_count++];
+                        w->pc = pc;
+                        w->lo = index;
+                        w->hi = (index + len - 1) & 0xFFFu;
+                    }
+                }
+                if ((kk == 0x33 || kk == 0x55 || kk == 0x65) && (quirks & QUIRK_LOADSTORE))
+                {
+                    index_known = 0;
+                }
+                break;
+            }
+
+            uint16_t next[2];
+            int count = block_successors(pc, op, next);
+            if (count < 0)
+            {
+                pc += 2;
+                continue;
+            }
+
+            if ((op >> 12) == 0x2)
+            {
+                mem_kind[next[0]] |= MEM_CALLED;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                if (next[i] < 0xFFE)
+                {
+                    mem_kind[next[i]] |= MEM_BLOCK;
+                    work[pending++] = next[i];
+                }
+            }
+            break;
+        }
+    }
+}
+
+/* Print the analysis as an annotated disassembly of the rom */
+int print_analysis()
+{
+    analyze_rom();
+
+    int instructions = 0, blocks = 0;
+    for (uint32_t a = PROGSTART; a < PROGSTART + rom_size; a++)
+    {
+        instructions += (mem_kind[a] & MEM_CODE) != 0;
+        blocks += (mem_kind[a] & (MEM_CODE | MEM_BLOCK)) == (MEM_CODE | MEM_BLOCK);
+    }
+    printf("; rom %016llx, %zu bytes, %d instructions in %d blocks\n", (unsigned long long)rom_hash, rom_size,
+           instructions, blocks);
+    if (analysis_computed_jump)
+    {
+        printf("; has computed jumps (Bnnn), code they reach is not followed\n");
+    }
+
+    uint32_t a = PROGSTART;
+    uint32_t end = PROGSTART + rom_size;
+    while (a < end)
+    {
+        if (mem_kind[a] & MEM_CODE)
+        {
+            if (mem_kind[a] & MEM_BLOCK)
+            {
+                printf("\n%s_%03x:\n", (mem_kind[a] & MEM_CALLED) ? "sub" : "block", a);
+            }
+
+            uint16_t op = (main_mem[a] << 8) | main_mem[a + 1];
+            char text[24];
+            disassemble(op, text, sizeof(text));
+            printf("    %03x  %04x  %-16s", a, op, text);
+
+            uint16_t next[2];
+            int count = block_successors(a, op, next);
+            if (count == 0)
+            {
+                printf("; -> %s", (op >> 12) == 0xB ? "computed" : "return");
+            }
+            for (int i = 0; i < count; i++)
+            {
+                printf("%s%03x", i ? " " : "; -> ", next[i]);
+            }
+            printf("\n");
+            a += 2;
+            continue;
+        }
+
+        // a row of up to 8 bytes of data of the same kind
+        uint8_t kind = mem_kind[a] & (MEM_SPRITE | MEM_READ | MEM_WRITTEN);
+        printf("    %03x  db", a);
+        uint32_t row = a;
+        while (a < end && a < row + 8 && !(mem_kind[a] & MEM_CODE) &&
+               (mem_kind[a] & (MEM_SPRITE | MEM_READ | MEM_WRITTEN)) == kind)
+        {
+            printf(" %02x", main_mem[a]);
+            a++;
+        }
+        printf("%*s;%s%s%s%s\n", (int)(row + 8 - a) * 3, "", (kind & MEM_SPRITE) ? " sprite" : "",
+               (kind & MEM_READ) ? " read" : "", (kind & MEM_WRITTEN) ? " written" : "", kind ? "" : " unreached");
+    }
+
+    for (int i = 0; i < analysis_write_count; i++)
+    {
+        struct analysis_write *w = &analysis_writes[i];
+        // the written range can wrap past the end of memory
+        uint16_t len = ((w->hi - w->lo) & 0xFFFu) + 1;
+        for (uint16_t k = 0; k < len; k++)
+        {
+            uint16_t addr = (w->lo + k) & 0xFFFu;
+            if (mem_kind[addr] & (MEM_CODE | MEM_OPERAND))
+            {
+                printf("; self-modifying: %03x writes %03x-%03x over code at %03x\n", w->pc, w->lo, w->hi, addr);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/* END ROM ANALYSIS */
+
+/* AHEAD OF TIME TRANSLATION */
+
+// handler for each instruction group, the groups with sub tables are named per opcode
+const char *aot_handlers[0x10] = {"exc_zero_codes", "op_1NNN", "op_2NNN", "op_3xkk", "op_4xkk", "op_5xy0",
+                                  "op_6xkk", "op_7xkk", NULL, "op_9xy0", "op_Annn", "op_Bnnn",
+                                  "op_Cxkk", "op_Dxyn", NULL, NULL};
+
+/* Name of the handler that executes op */
+void aot_handler(uint16_t op, char *buf, size_t size)
+{
+    char text[24];
+    switch (op >> 12)
+    {
+    case 0x8:
+    case 0xE:
+    case 0xF:
+        if (!disassemble(op, text, sizeof(text)))
+        {
+            snprintf(buf, size, "op_invalid");
+            break;
+        }
+        if ((op >> 12) == 0x8)
+            snprintf(buf, size, "op_8xy%X", op & 0xFu);
+        else
+            snprintf(buf, size, "op_%cx%02X", (op >> 12) == 0xE ? 'E' : 'F', op & 0xFFu);
+        break;
+    default:
+        snprintf(buf, size, "%s", aot_handlers[op >> 12]);
+        break;
+    }
+}
+
+/*
+    Translate the loaded rom into C. Every reachable instruction gets a label
+    and runs by setting opcode and the program counter the way cycle() does
+    and calling its handler. Straight runs of code fall through from one
+    instruction to the next, anything that can change the program counter
+    goes back through a switch on the program counter
+*/
+int print_aot()
+{
+    analyze_rom();
+
+    // number the blocks in address order
+    int16_t block_of[0x1000];
+    int16_t blocks = 0;
+    for (int a = 0; a < 0x1000; a++)
+    {
+        block_of[a] = -1;
+    }
+    for (uint32_t a = PROGSTART; a < 0xFFE; a++)
+    {
+        if (!(mem_kind[a] & MEM_CODE))
+        {
+            continue;
+        }
+        if ((mem_kind[a] & MEM_BLOCK) || a < 2 || !(mem_kind[a - 2] & MEM_CODE))
+        {
+            blocks++;
+        }
+        block_of[a] = block_of[a + 1] = blocks - 1;
+    }
+
+    printf("/* chip-8 rom %016llx translated by chip8 -C, build with make aot ROM=<rom> */\n\n",
+           (unsigned long long)rom_hash);
+    printf("#include <stdint.h>\n#include <stddef.h>\n\n");
+    printf("extern uint16_t opcode;\nextern uint16_t program_counter;\nextern uint16_t index_register;\n");
+    printf("extern uint8_t idle;\nint aot_store(uint16_t addr, uint16_t len);\n\n");
+
+    // declare each handler the rom uses once
+    char declared[0x40][16];
+    int declared_count = 0;
+    for (uint32_t a = PROGSTART; a < 0xFFE; a++)
+    {
+        if (!(mem_kind[a] & MEM_CODE))
+        {
+            continue;
+        }
+        char name[16];
+        aot_handler((main_mem[a] << 8) | main_mem[a + 1], name, sizeof(name));
+        int known = 0;
+        for (int i = 0; i < declared_count; i++)
+        {
+            known |= !strcmp(declared[i], name);
+        }
+        if (!known && declared_count < 0x40)
+        {
+            strcpy(declared[declared_count++], name);
+            printf("void %s(void);\n", name);
+        }
+    }
+
+    printf("\nconst uint64_t aot_rom_hash = 0x%016llxu;\n", (unsigned long long)rom_hash);
+    printf("const size_t aot_rom_size = %zu;\nconst uint8_t aot_rom[] = {", rom_size);
+    for (size_t i = 0; i < rom_size; i++)
+    {
+        printf("%s0x%02x,", (i % 16) ? " " : "\n    ", rom_image[i]);
+    }
+    printf("\n};\n\nconst int16_t aot_block_of[0x1000] = {");
+    for (int a = 0; a < 0x1000; a++)
+    {
+        printf("%s%d,", (a % 16) ? " " : "\n    ", block_of[a]);
+    }
+    printf("\n};\n\nconst size_t aot_blocks = %d;\nuint8_t aot_dirty[%d];\n\n", blocks ? blocks : 1,
+           blocks ? blocks : 1);
+
+    printf("uint32_t aot_run(uint32_t budget)\n{\n    uint32_t n = 0;\n\ndispatch:\n");
+    printf("    if (n >= budget || idle)\n        return n;\n\n    switch (program_counter)\n    {\n");
+    for (uint32_t a = PROGSTART; a < 0xFFE; a++)
+    {
+        if (mem_kind[a] & MEM_CODE)
+        {
+            printf("    case 0x%03x:\n        if (aot_dirty[%d])\n            return n;\n        goto L%03x;\n", a,
+                   block_of[a], a);
+        }
+    }
+    printf("    default:\n        return n;\n    }\n");
+
+    int falls = 0;
+    for (uint32_t a = PROGSTART; a < 0xFFE; a++)
+    {
+        if (!(mem_kind[a] & MEM_CODE))
+        {
+            continue;
+        }
+
+        uint16_t op = (main_mem[a] << 8) | main_mem[a + 1];
+        char name[16], text[24];
+        aot_handler(op, name, sizeof(name));
+        disassemble(op, text, sizeof(text));
+
+        // falling into a block from the one before still has to check it
+        if ((mem_kind[a] & MEM_BLOCK) && falls)
+        {
+            printf("    if (aot_dirty[%d])\n        return n;\n", block_of[a]);
+        }
+
+        printf("L%03x: /* %s */\n", a, text);
+        printf("    program_counter = 0x%03x;\n    opcode = 0x%04x;\n", a + 2, op);
+
+        uint16_t next[2];
+        int ends = block_successors(a, op, next) >= 0 || (op & 0xF0FFu) == 0xF00Au ||
+                   !(mem_kind[a + 2] & MEM_CODE);
+        if ((op & 0xF0FFu) == 0xF033u || (op & 0xF0FFu) == 0xF055u)
+        {
+            // a store over translated code hands the rest of the block back to the interpreter
+            printf("    int hit_%03x = aot_store(index_register, %d);\n", a,
+                   (op & 0xFFu) == 0x33 ? 3 : ((op & 0xF00u) >> 8) + 1);
+            printf("    %s();\n    n++;\n    if (hit_%03x)\n        goto dispatch;\n", name, a);
+        }
+        else
+        {
+            printf("    %s();\n    n++;\n", name);
+        }
+
+        falls = !ends;
+        if (ends)
+        {
+            printf("    goto dispatch;\n");
+        }
+        else
+        {
+            printf("    if (n == budget)\n        return n;\n");
+        }
+    }
+    printf("}\n");
+    return 0;
+}
+
+/* END AHEAD OF TIME TRANSLATION */
+
+/* VIDEO CAPTURE */
+
+/*
+    Every emulated frame is copied into a ring and a background thread
+    encodes it, so recording only costs the copy. A file ending in .gif
+    gets an animated gif at 8 times the resolution of the display, with
+    only the rectangle that changed stored for each frame. Anything else
+    gets the raw frames, 32 rows of 8 bytes with the leftmost pixel in
+    the top bit, one per 60th of a second
+*/
+
+// frames the ring holds, about four seconds of emulation
+const int CAPTURE_FRAMES = 256;
+
+// gif pixels per display pixel
+const int GIF_SCALE = 8;
+
+FILE *capture_file = NULL;
+uint8_t capture_gif = 0x0;
+uint32_t capture_ring[256][64 * 32];
+uint32_t capture_head = 0;
+uint32_t capture_tail = 0;
+uint8_t capture_done = 0x0;
+pthread_t capture_thread;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+
+// the encoder's view of the recording, only touched by the capture thread
+uint64_t gif_shown[32];
+uint64_t gif_pending[32];
+uint32_t gif_pending_frame = 0;
+uint32_t gif_frames = 0;
+
+// lzw output, bits are gathered into a sub block of up to 255 bytes
+uint32_t lzw_bits = 0;
+int lzw_count = 0;
+uint8_t lzw_block[255];
+int lzw_fill = 0;
+
+/* add a code of size bits to the lzw output */
+void lzw_put(uint32_t code, int size)
+{
+    lzw_bits |= code << lzw_count;
+    lzw_count += size;
+    while (lzw_count >= 8)
+    {
+        lzw_block[lzw_fill++] = lzw_bits & 0xFFu;
+        lzw_bits >>= 8;
+        lzw_count -= 8;
+        if (lzw_fill == 255)
+        {
+            fputc(255, capture_file);
+            fwrite(lzw_block, 1, 255, capture_file);
+            lzw_fill = 0;
+        }
+    }
+}
+
+/*
+    Write the gif image data for a w x h rectangle of 2 colour pixels at
+    x, y in display pixels. With only 2 colours every code has at most
+    2 children, so the dictionary is a plain table
+*/
+void gif_image(const uint64_t *rows, int x, int y, int w, int h)
+{
+    static int16_t child[4096][2];
+    const uint32_t clear = 4, end = 5;
+    uint32_t next = 6;
+    int size = 3;
+
+    fputc(2, capture_file);
+    memset(child, 0xFF, sizeof(child));
+    lzw_put(clear, size);
+
+    int32_t prefix = -1;
+    for (int py = 0; py < h * GIF_SCALE; py++)
+    {
+        uint64_t row = rows[y + py / GIF_SCALE];
+        for (int px = 0; px < w * GIF_SCALE; px++)
+        {
+            int pixel = (row >> (63 - (x + px / GIF_SCALE))) & 0x1u;
+            if (prefix < 0)
+            {
+                prefix = pixel;
+                continue;
+            }
+            if (child[prefix][pixel] >= 0)
+            {
+                prefix = child[prefix][pixel];
+                continue;
+            }
+
+            lzw_put(prefix, size);
+            if (next < 4096)
+            {
+                child[prefix][pixel] = next;
+                if (next == (1u << size) && size < 12)
+                {
+                    size++;
+                }
+                next++;
+            }
+            else
+            {
+                // a full dictionary starts over
+                lzw_put(clear, size);
+                memset(child, 0xFF, sizeof(child));
+                next = 6;
+                size = 3;
+            }
+            prefix = pixel;
+        }
+    }
+    lzw_put(prefix, size);
+    lzw_put(end, size);
+    if (lzw_count)
+    {
+        lzw_put(0, 8 - lzw_count);
+    }
+    if (lzw_fill)
+    {
+        fputc(lzw_fill, capture_file);
+        fwrite(lzw_block, 1, lzw_fill, capture_file);
+        lzw_fill = 0;
+    }
+    fputc(0, capture_file);
+}
+
+/* write a 16 bit little endian gif field */
+void gif_put16(uint32_t value)
+{
+    fputc(value & 0xFFu, capture_file);
+    fputc((value >> 8) & 0xFFu, capture_file);
+}
+
+/* Write the pending frame, shown for delay hundredths of a second, as the rectangle that changed */
+void gif_frame(uint32_t delay)
+{
+    int x0 = 64, x1 = -1, y0 = 32, y1 = -1;
+    for (int y = 0; y < 32; y++)
+    {
+        uint64_t diff = gif_pending[y] ^ gif_shown[y];
+        if (!diff)
+        {
+            continue;
+        }
+        y0 = y < y0 ? y : y0;
+        y1 = y;
+        int left = __builtin_clzll(diff);
+        int right = 63 - __builtin_ctzll(diff);
+        x0 = left < x0 ? left : x0;
+        x1 = right > x1 ? right : x1;
+    }
+    if (gif_frames == 0)
+    {
+        x0 = y0 = 0;
+        x1 = 63;
+        y1 = 31;
+    }
+    else if (x1 < 0)
+    {
+        // nothing changed, a single pixel still carries the delay
+        x0 = x1 = y0 = y1 = 0;
+    }
+
+    // graphic control: leave the frame in place for the next one to draw over
+    fputc(0x21, capture_file);
+    fputc(0xF9, capture_file);
+    fputc(4, capture_file);
+    fputc(0x04, capture_file);
+    gif_put16(delay);
+    fputc(0, capture_file);
+    fputc(0, capture_file);
+
+    fputc(0x2C, capture_file);
+    gif_put16(x0 * GIF_SCALE);
+    gif_put16(y0 * GIF_SCALE);
+    gif_put16((x1 - x0 + 1) * GIF_SCALE);
+    gif_put16((y1 - y0 + 1) * GIF_SCALE);
+    fputc(0, capture_file);
+    gif_image(gif_pending, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+
+    memcpy(gif_shown, gif_pending, sizeof(gif_shown));
+    gif_frames++;
+}
+
+/* hundredths of a second at the start of frame */
+uint32_t gif_time(uint32_t frame)
+{
+    return (uint32_t)(((uint64_t)frame * 100 + 30) / 60);
+}
+
+/*
+    Add a recorded frame to the gif. A frame is only written once the
+    next change shows how long it stayed up, and changes that come
+    quicker than the 2 hundredths of a second viewers can show replace
+    the pending frame instead
+*/
+void gif_add(const uint64_t *rows, uint32_t frame)
+{
+    if (frame == 0)
+    {
+        memcpy(gif_pending, rows, sizeof(gif_pending));
+        return;
+    }
+    if (!memcmp(rows, gif_pending, sizeof(gif_pending)))
+    {
+        return;
+    }
+    uint32_t shown = gif_time(frame) - gif_time(gif_pending_frame);
+    if (shown >= 2)
+    {
+        gif_frame(shown);
+        gif_pending_frame = frame;
+    }
+    memcpy(gif_pending, rows, sizeof(gif_pending));
+}
+
+/* encode recorded frames until the recording is closed */
+void *capture_writer(void *arg)
+{
+    (void)arg;
+    uint32_t frame = 0;
+    pthread_mutex_lock(&capture_lock);
+    for (;;)
+    {
+        while (capture_tail == capture_head && !capture_done)
+        {
+            pthread_cond_wait(&capture_cond, &capture_lock);
+        }
+        if (capture_tail == capture_head)
+        {
+            break;
+        }
+        uint32_t *pixels = capture_ring[capture_tail % CAPTURE_FRAMES];
+        pthread_mutex_unlock(&capture_lock);
+
+        uint64_t rows[32];
+        for (int y = 0; y < 32; y++)
+        {
+            rows[y] = pack_row(&pixels[y * SCREEN_WIDTH]);
+        }
+        if (capture_gif)
+        {
+            gif_add(rows, frame);
+        }
+        else
+        {
+            for (int y = 0; y < 32; y++)
+            {
+                for (int b = 0; b < 8; b++)
+                {
+                    fputc((rows[y] >> (56 - 8 * b)) & 0xFFu, capture_file);
+                }
+            }
+        }
+        frame++;
+
+        pthread_mutex_lock(&capture_lock);
+        capture_tail++;
+        pthread_cond_broadcast(&capture_cond);
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    if (capture_gif && frame)
+    {
+        uint32_t shown = gif_time(frame) - gif_time(gif_pending_frame);
+        gif_frame(shown < 2 ? 2 : shown);
+    }
+    return NULL;
+}
+
+void capture_open(char *filename)
+{
+    capture_file = fopen(filename, "wb");
+    if (!capture_file)
+    {
+        printf("Could not write recording %s\n", filename);
+        exit(1);
+    }
+
+    size_t len = strlen(filename);
+    capture_gif = len >= 4 && !strcmp(filename + len - 4, ".gif");
+    if (capture_gif)
+    {
+        // black and white global palette, looping forever
+        fwrite("GIF89a", 1, 6, capture_file);
+        gif_put16(SCREEN_WIDTH * GIF_SCALE);
+        gif_put16(SCREEN_HEIGHT * GIF_SCALE);
+        fputc(0x80, capture_file);
+        fputc(0, capture_file);
+        fputc(0, capture_file);
+        fwrite("\0\0\0\xFF\xFF\xFF", 1, 6, capture_file);
+        fwrite("\x21\xFF\x0BNETSCAPE2.0\x03\x01\0\0\0", 1, 19, capture_file);
+    }
+    pthread_create(&capture_thread, NULL, capture_writer, NULL);
+}
+
+/* copy the frame just run into the ring, only waiting if the encoder is a whole ring behind */
+void capture_frame()
+{
+    pthread_mutex_lock(&capture_lock);
+    while (capture_head - capture_tail == (uint32_t)CAPTURE_FRAMES)
+    {
+        pthread_cond_wait(&capture_cond, &capture_lock);
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    memcpy(capture_ring[capture_head % CAPTURE_FRAMES], video, sizeof(capture_ring[0]));
+
+    pthread_mutex_lock(&capture_lock);
+    capture_head++;
+    pthread_cond_signal(&capture_cond);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_close()
+{
+    if (!capture_file)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    capture_done = 0x1;
+    pthread_cond_broadcast(&capture_cond);
+    pthread_mutex_unlock(&capture_lock);
+
+    pthread_join(capture_thread, NULL);
+    if (capture_gif)
+    {
+        fputc(0x3B, capture_file);
+    }
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+/* END VIDEO CAPTURE */
+
+/* HEADLESS BATCH RUNNER */
+
+// file to record an execution trace of the rom into
+char *trace_name = NULL;
+
+// file to record the display of the rom into
+char *capture_name = NULL;
+
+// frames to run roms that have no frame count in the rom database
+const uint32_t DEFAULT_BATCH_FRAMES = 600;
+
+/*
+    Check if the idle loop the rom is sitting in would keep spinning
+    for another whole frame. A key wait finishes once the caller holds
+    a key (the environment api sets the keypad before running frames)
+    and a timer poll loop once the delay timer reaches the value it is
+    waiting for
+*/
+int still_idle()
+{
+    if (idle == IDLE_KEY)
+    {
+        for (int k = 0; k < 16; k++)
+        {
+            if (user_keypad[k])
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (idle != IDLE_TIMER)
+    {
+        return 1;
+    }
+
+    uint8_t x = main_mem[program_counter & 0xFFFu] & 0xFu;
+    uint8_t skip = main_mem[(program_counter + 2) & 0xFFFu] >> 4;
+    uint8_t kk = main_mem[(program_counter + 3) & 0xFFFu];
+    int exits = (skip == 0x3) ? delay_timer == kk : delay_timer != kk;
+    if (exits)
+    {
+        return 0;
+    }
+
+    // the loop would have read the timer into Vx during the frame
+    registers[x] = delay_timer;
+    return 1;
+}
+
+/* Run the loaded rom for a number of frames as fast as possible */
+void run_frames(uint32_t frames)
+{
+    for (uint32_t f = 0; f < frames; f++)
+    {
+        (*frame_core)();
+        if (capture_file)
+        {
+            capture_frame();
+        }
+
+        // fast forward through frames the rom would spend idle
+        while (idle && f + 1 < frames && still_idle())
+        {
+            tick_timers();
+            f++;
+
+            // a skipped frame still ends a frame of the trace so its frame numbers match the run
+            if (trace_file)
+            {
+                trace_frame_end();
+            }
+            if (capture_file)
+            {
+                capture_frame();
+            }
+        }
+    }
+}
+
+/*
+    Run the loaded rom headless and print the hash of its display.
+    The display is checked against the golden hash in the rom database
+    when the run is as long as the one the golden hash was taken from.
+    Returns 1 if the display does not match
+*/
+int run_batch_rom(const char *name, uint32_t frames)
+{
+    apply_romdb();
+
+    if (trace_name)
+    {
+        trace_open(trace_name);
+    }
+    if (capture_name)
+    {
+        capture_open(capture_name);
+    }
+    select_core();
+
+    struct romdb_entry *entry = find_romdb(rom_hash);
+    if (!frames)
+    {
+        frames = entry && entry->frames ? entry->frames : DEFAULT_BATCH_FRAMES;
+    }
+
+    // every run of a rom has to see the same random numbers
+    rng_state = RNG_SEED;
+    run_frames(frames);
+
+    if (trace_name)
+    {
+        trace_close();
+        select_core();
+    }
+    capture_close();
+
+    uint64_t display = hash_bytes(video, sizeof(console.video));
+    const char *result = "-";
+    int failed = 0;
+    if (entry && entry->golden && entry->frames == frames)
+    {
+        failed = display != entry->golden;
+        result = failed ? "FAIL" : "ok";
+    }
+
+    printf("%016llx %-24s %6u %016llx %s\n", (unsigned long long)rom_hash, name, frames,
+           (unsigned long long)display, result);
+    return failed;
+}
+
+/* Run the roms named on the command line, or every rom in the bundle if none are named */
+int run_batch(char *bundle_file, char **roms, int count, uint32_t frames)
+{
+    int failed = 0;
+
+    if (bundle_file)
+    {
+        open_bundle(bundle_file);
+
+        uint32_t total = count ? (uint32_t)count : bundle_count;
+        for (uint32_t i = 0; i < total; i++)
+        {
+            const struct bundle_entry *entry = count ? find_bundle_entry(roms[i]) : &bundle_index[i];
+            if (!entry)
+            {
+                printf("No rom %s in bundle\n", roms[i]);
+                failed = 1;
+                continue;
+            }
+
+            reset_machine();
+            load_rom_image(main_mem, bundle + entry->offset, entry->size, entry->hash);
+            failed |= run_batch_rom(entry->name, frames);
+        }
+
+        munmap((void *)bundle, bundle_size);
+        return failed;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        reset_machine();
+        read_rom(main_mem, roms[i]);
+        failed |= run_batch_rom(roms[i], frames);
+        munmap((void *)rom_image, rom_size);
+    }
+    return failed;
+}
+
+/* END HEADLESS BATCH RUNNER */
+
+/* FRAMEBUFFER SERVER */
+
+/*
+    Serves the display over a socket instead of a window. Every frame that
+    changes the display is sent as a 'F' byte, a big endian mask of the rows
+    that changed and then for each of those rows the xor of its 64 pixels
+    with the last frame sent, one bit per pixel, run length encoded:
+    a byte with the top bit set stands for (byte & 0x7F) + 1 zero bytes,
+    any other byte is followed by byte + 1 literal bytes.
+    The client sends a byte per keypad event, the key in the low nibble
+    with the top bit set for a press and clear for a release
+*/
+
+// set by SIGINT / SIGTERM to stop serving
+volatile sig_atomic_t server_quit = 0;
+
+// the display as the client last saw it, one bit per pixel
+uint64_t server_rows[32];
+
+// path of the unix socket being served on, removed when the server stops
+const char *server_path = NULL;
+
+/* signal handler that stops the server at the end of the frame */
+void server_stop(int sig)
+{
+    (void)sig;
+    server_quit = 1;
+}
+
+/* Listen on a tcp port on the loopback address when addr is a number, otherwise on a unix socket path */
+int server_listen(const char *addr)
+{
+    int fd;
+    char *end;
+    unsigned long port = strtoul(addr, &end, 10);
+    if (*addr && !*end)
+    {
+        struct sockaddr_in in = {0};
+        in.sin_family = AF_INET;
+        in.sin_port = htons((uint16_t)port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int on = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            bind(fd, (struct sockaddr *)&in, sizeof(in)) < 0 || listen(fd, 1) < 0)
+        {
+            printf("Could not listen on port %s\n", addr);
+            exit(1);
+        }
+    }
+    else
+    {
+        struct sockaddr_un un = {0};
+        un.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(un.sun_path))
+        {
+            printf("Socket path %s is too long\n", addr);
+            exit(1);
+        }
+        strcpy(un.sun_path, addr);
+        unlink(addr);
+        server_path = addr;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(fd, 1) < 0)
+        {
+            printf("Could not listen on %s\n", addr);
+            exit(1);
+        }
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* Encode the rows of the display that changed since the last frame sent into buf, returns 0 if none did */
+size_t server_encode(uint8_t *buf)
+{
+    uint32_t mask = 0;
+    size_t len = 5;
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    {
+        uint64_t row = display_row(y);
+        uint64_t delta = row ^ server_rows[y];
+        if (!delta)
+        {
+            continue;
+        }
+        server_rows[y] = row;
+        mask |= 0x80000000u >> y;
+
+        uint8_t bytes[8];
+        for (int i = 0; i < 8; i++)
+        {
+            bytes[i] = (uint8_t)(delta >> (56 - 8 * i));
+        }
+        int i = 0;
+        while (i < 8)
+        {
+            int run = i;
+            while (run < 8 && !bytes[run])
+            {
+                run++;
+            }
+            if (run > i)
+            {
+                buf[len++] = 0x80u | (run - i - 1);
+                i = run;
+                continue;
+            }
+            int lit = i;
+            while (lit < 8 && bytes[lit])
+            {
+                lit++;
+            }
+            buf[len++] = lit - i - 1;
+            while (i < lit)
+            {
+                buf[len++] = bytes[i++];
+            }
+        }
+    }
+    if (!mask)
+    {
+        return 0;
+    }
+    buf[0] = 'F';
+    buf[1] = mask >> 24;
+    buf[2] = mask >> 16;
+    buf[3] = mask >> 8;
+    buf[4] = mask;
+    return len;
+}
+
+/* Apply the keypad events the client has sent, returns 0 once it has gone away */
+int server_keys(int client)
+{
+    uint8_t events[64];
+    ssize_t n;
+    while ((n = recv(client, events, sizeof(events), MSG_DONTWAIT)) > 0)
+    {
+        for (ssize_t i = 0; i < n; i++)
+        {
+            user_keypad[events[i] & 0xFu] = events[i] >> 7;
+        }
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Run the loaded rom in real time serving its display to one client at a time */
+int run_server(const char *addr)
+{
+    int fd = server_listen(addr);
+    int client = -1;
+    signal(SIGINT, server_stop);
+    signal(SIGTERM, server_stop);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving on %s\n", addr);
+    fflush(stdout);
+
+    // a full frame is 5 bytes of header and at most 12 bytes per row, the
+    // worst row alternates set and zero bytes: four 2 byte literals and
+    // four 1 byte zero runs
+    uint8_t buf[5 + 12 * 32];
+    while (!server_quit)
+    {
+        uint32_t frame_start = SDL_GetTicks();
+
+        if (client < 0 && (client = accept(fd, NULL, NULL)) >= 0)
+        {
+            // a new client starts from a blank display
+            memset(server_rows, 0, sizeof(server_rows));
+        }
+        if (client >= 0 && !server_keys(client))
+        {
+            close(client);
+            client = -1;
+            memset(user_keypad, 0, sizeof(user_keypad));
+        }
+
+        (*frame_core)();
+        if (capture_file)
+        {
+            capture_frame();
+        }
+
+        size_t len = client >= 0 ? server_encode(buf) : 0;
+        if (len && send(client, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+        {
+            close(client);
+            client = -1;
+        }
+
+        uint32_t elapsed = SDL_GetTicks() - frame_start;
+        if (elapsed < FRAME_MS)
+        {
+            SDL_Delay(FRAME_MS - elapsed);
+        }
+    }
+
+    if (client >= 0)
+    {
+        close(client);
+    }
+    close(fd);
+    if (server_path)
+    {
+        unlink(server_path);
+    }
+    return 0;
+}
+
+/* END FRAMEBUFFER SERVER */
+
+/* ENVIRONMENT API */
+
+struct chip8_env
+{
+    uint32_t count;
+    struct machine *live;
+    struct machine *saved;
+};
+
+// the rom's speed, quirks and core are global, so only one environment can exist at a time
+struct chip8_env *env_alive = NULL;
+
+struct chip8_env *chip8_env_create(char *rom, char *romdb, uint32_t count)
+{
+    if (env_alive)
+    {
+        return NULL;
+    }
+    setup_functables();
+    if (romdb && !romdb_len && load_romdb(romdb) < 0)
+    {
+        return NULL;
+    }
+
+    reset_machine();
+    if (map_rom(main_mem, rom))
+    {
+        return NULL;
+    }
+    apply_romdb();
+    select_core();
+
+    // a library has to leave running out of memory to its caller
+    struct chip8_env *env = malloc(sizeof(struct chip8_env));
+    struct machine *live = calloc(count, sizeof(struct machine));
+    struct machine *saved = calloc(count, sizeof(struct machine));
+    if (!env || !live || !saved)
+    {
+        free(env);
+        free(live);
+        free(saved);
+        munmap((void *)rom_image, rom_size);
+        return NULL;
+    }
+    env->count = count;
+    env->live = live;
+    env->saved = saved;
+    save_pristine();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        env->live[i] = env->saved[i] = pristine;
+    }
+    env_alive = env;
+    return env;
+}
+
+void chip8_env_step(struct chip8_env *env, const uint16_t *actions, uint32_t frames, uint8_t *screens,
+                    uint8_t *ram)
+{
+    for (uint32_t i = 0; i < env->count; i++)
+    {
+        struct machine *m = &env->live[i];
+        for (int k = 0; k < 16; k++)
+        {
+            m->user_keypad[k] = (actions[i] >> k) & 0x1u;
+        }
+        load_machine(m);
+        run_frames(frames);
+        save_machine(m);
+
+        if (screens)
+        {
+            uint8_t *screen = &screens[i * CHIP8_ENV_SCREEN];
+            for (int y = 0; y < SCREEN_HEIGHT; y++)
+            {
+                uint64_t row = display_row(y);
+                for (int b = 0; b < 8; b++)
+                {
+                    screen[y * 8 + b] = (uint8_t)(row >> (56 - 8 * b));
+                }
+            }
+        }
+        if (ram)
+        {
+            memcpy(&ram[i * CHIP8_ENV_RAM], m->main_mem, sizeof(m->main_mem));
+        }
+    }
+
+    main_mem = console.main_mem;
+    video = console.video;
+}
+
+void chip8_env_save(struct chip8_env *env, uint32_t i)
+{
+    env->saved[i] = env->live[i];
+}
+
+void chip8_env_reset(struct chip8_env *env, uint32_t i)
+{
+    env->live[i] = env->saved[i];
+}
+
+void chip8_env_destroy(struct chip8_env *env)
+{
+    munmap((void *)rom_image, rom_size);
+    free(env->live);
+    free(env->saved);
+    free(env);
+    env_alive = NULL;
+}
+
+/* END ENVIRONMENT API */
+
+/* STATE SPACE SEARCH */
+
+/*
+    Explores the inputs a rom can be given breadth first. Every state is
+    stepped once with no key held and once holding each key, for
+    SEARCH_FRAMES frames, and only children no worker has seen before
+    are kept. A worker process per core takes states from the current
+    level, sharing the visited set, the code coverage and the next level
+    through shared memory. The first input sequence to reach each code
+    address is printed, one hex digit per step with - for no key
+*/
+
+// frames each input is held for, a tenth of a second
+const uint32_t SEARCH_FRAMES = 6;
+
+// inputs in a path can be no longer than this
+const int SEARCH_MAX_DEPTH = 64;
+
+// states kept per level, children past this are dropped
+const uint32_t SEARCH_FRONTIER = 0x4000;
+
+// slots in the visited set of state hashes
+const uint32_t SEARCH_VISITED = 0x400000;
+
+// a state with the display packed, laid out without padding so the part before depth hashes as is
+struct search_node
+{
+    uint64_t rows[32];
+    uint16_t stack[0x10];
+    uint16_t index_register;
+    uint16_t stack_pointer;
+    uint16_t program_counter;
+    uint8_t registers[0x10];
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t main_mem[0x1000];
+
+    uint8_t depth;
+    char path[64 + 1];
+
+    // left out of the state hash so random numbers alone never tell states apart
+    uint32_t rng_state;
 };
 
-/*
-    represents 1 cpu cycle
-    grab opcode from program counter
-    increase program counter by 2
-    execute the instruction represented by the opcode
+// what the workers share
+struct search_shared
+{
+    pthread_barrier_t barrier;
+    uint32_t level_size[2];
+    uint32_t taken;
+    uint64_t states;
+    uint64_t unique;
+    uint64_t dropped;
+    uint32_t covered_count;
+    uint8_t covered[0x1000];
+};
 
-*/
-void cycle()
+struct search_shared *search = NULL;
+uint64_t *search_visited = NULL;
+struct search_node *search_levels[2];
+
+// inputs that led to the state being stepped, for reporting new code
+const char *search_path = NULL;
+
+/* Map memory every forked worker shares */
+void *search_map(size_t size)
 {
-    opcode = (main_mem[program_counter] << 8) | main_mem[program_counter + 1];
-    program_counter += 2;
-    
-    print_state();
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        printf("Could not map %zu bytes for the search\n", size);
+        exit(1);
+    }
+    return p;
+}
 
-    // execute the opcode
-    (*main_table[(opcode & 0xF000) >> 12])();
+/* Hash the state part of a node 8 bytes at a time */
+uint64_t hash_state(const struct search_node *node)
+{
+    const uint8_t *p = (const uint8_t *)node;
+    size_t size = offsetof(struct search_node, depth);
+    uint64_t h = 0xcbf29ce484222325u;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15u;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3u;
+    }
+    return h ? h : 1;
+}
 
+/* Add a state hash to the visited set, returns 0 if some worker already had it */
+int search_visit(uint64_t h)
+{
+    uint32_t slot = (uint32_t)h & (SEARCH_VISITED - 1);
+    for (int probe = 0; probe < 64; probe++)
+    {
+        uint64_t seen = 0;
+        uint64_t *entry = &search_visited[(slot + probe) & (SEARCH_VISITED - 1)];
+        if (__atomic_compare_exchange_n(entry, &seen, h, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return 1;
+        }
+        if (seen == h)
+        {
+            return 0;
+        }
+    }
+    // a crowded neighbourhood only costs a repeat visit
+    return 1;
+}
 
-    if (delay_timer >= 1)
+/* Report the input sequence that first reached the code at pc */
+void search_cover(uint16_t pc)
+{
+    uint8_t clear = 0;
+    if (__atomic_compare_exchange_n(&search->covered[pc], &clear, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        delay_timer--;
+        __atomic_fetch_add(&search->covered_count, 1, __ATOMIC_RELAXED);
+        char line[96];
+        int len = snprintf(line, sizeof(line), "%03x %s\n", pc, search_path);
+        // a single write keeps lines from different workers whole
+        if (write(STDOUT_FILENO, line, len) < 0)
+        {
+            exit(1);
+        }
     }
-    if (sound_timer >= 1)
+}
+
+/* the search core, like vip_frame with the vip quirk, marking the code it reaches */
+uint32_t search_vip_frame()
+{
+    idle = IDLE_NONE;
+    vip_clock += VIP_FRAME_CYCLES - VIP_DISPLAY_CYCLES;
+    uint32_t i = 0;
+    while (vip_clock > 0 && !idle)
     {
-        sound_timer--;
+        if (!search->covered[program_counter & 0xFFFu])
+        {
+            search_cover(program_counter & 0xFFFu);
+        }
+        opcode = (main_mem[program_counter & 0xFFFu] << 8) | main_mem[(program_counter + 1) & 0xFFFu];
+        program_counter = (program_counter + 2) & 0xFFFu;
+        vip_clock -= vip_cost(opcode);
+        (*main_table[(opcode & 0xF000) >> 12])();
+        i++;
+
+        if ((opcode >> 12) == 0xD)
+        {
+            break;
+        }
+    }
+
+    if (vip_clock > 0)
+    {
+        vip_clock = 0;
+    }
+    tick_timers();
+    return i;
+}
+
+/* the search core, runs a frame marking the code it reaches */
+uint32_t search_frame()
+{
+    if (quirks & QUIRK_VIP)
+    {
+        return search_vip_frame();
+    }
+
+    idle = IDLE_NONE;
+    uint32_t i = 0;
+    for (; i < ipf && !idle; i++)
+    {
+        if (!search->covered[program_counter & 0xFFFu])
+        {
+            search_cover(program_counter & 0xFFFu);
+        }
+        cycle();
+    }
+    tick_timers();
+    return i;
+}
+
+/* Make node the running machine */
+void node_load(const struct search_node *node)
+{
+    memcpy(stack, node->stack, sizeof(stack));
+    index_register = node->index_register;
+    stack_pointer = node->stack_pointer;
+    program_counter = node->program_counter;
+    memcpy(registers, node->registers, sizeof(registers));
+    delay_timer = node->delay_timer;
+    sound_timer = node->sound_timer;
+    rng_state = node->rng_state;
+    memcpy(main_mem, node->main_mem, sizeof(node->main_mem));
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    {
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+        {
+            video[y * SCREEN_WIDTH + x] = ((node->rows[y] >> (63 - x)) & 0x1u) ? 0xFFFFFFFF : 0x0;
+        }
+    }
+}
+
+/* Copy the running machine into node */
+void node_save(struct search_node *node)
+{
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    {
+        node->rows[y] = display_row(y);
+    }
+    memcpy(node->stack, stack, sizeof(stack));
+    node->index_register = index_register;
+    node->stack_pointer = stack_pointer;
+    node->program_counter = program_counter;
+    memcpy(node->registers, registers, sizeof(registers));
+    node->delay_timer = delay_timer;
+    node->sound_timer = sound_timer;
+    node->rng_state = rng_state;
+    memcpy(node->main_mem, main_mem, sizeof(node->main_mem));
+}
+
+/* Expand states from the current level until there are none left, keeping the new children in the next */
+void search_level(int depth, struct search_node *scratch)
+{
+    struct search_node *level = search_levels[depth & 1];
+    struct search_node *next = search_levels[(depth + 1) & 1];
+    uint32_t n;
+    while ((n = __atomic_fetch_add(&search->taken, 1, __ATOMIC_RELAXED)) < search->level_size[depth & 1])
+    {
+        struct search_node *from = &level[n];
+        for (int action = 0; action <= 16; action++)
+        {
+            memcpy(scratch->path, from->path, from->depth);
+            scratch->path[from->depth] = action ? "0123456789abcdef"[action - 1] : '-';
+            scratch->path[from->depth + 1] = '\0';
+            scratch->depth = from->depth + 1;
+            search_path = scratch->path;
+
+            node_load(from);
+            memset(user_keypad, 0, sizeof(user_keypad));
+            if (action)
+            {
+                user_keypad[action - 1] = 1;
+            }
+            for (uint32_t f = 0; f < SEARCH_FRAMES; f++)
+            {
+                search_frame();
+            }
+            node_save(scratch);
+            __atomic_fetch_add(&search->states, 1, __ATOMIC_RELAXED);
+
+            if (!search_visit(hash_state(scratch)))
+            {
+                continue;
+            }
+            __atomic_fetch_add(&search->unique, 1, __ATOMIC_RELAXED);
+            uint32_t slot = __atomic_fetch_add(&search->level_size[(depth + 1) & 1], 1, __ATOMIC_RELAXED);
+            if (slot < SEARCH_FRONTIER)
+            {
+                memcpy(&next[slot], scratch, sizeof(*scratch));
+            }
+            else
+            {
+                __atomic_fetch_add(&search->dropped, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/* Search the inputs of the loaded rom up to depth steps deep on every core */
+int run_search(int depth)
+{
+    if (depth > SEARCH_MAX_DEPTH)
+    {
+        depth = SEARCH_MAX_DEPTH;
+    }
+    rng_state = RNG_SEED;
+
+    search = search_map(sizeof(struct search_shared));
+    search_visited = search_map(SEARCH_VISITED * sizeof(uint64_t));
+    search_levels[0] = search_map(SEARCH_FRONTIER * sizeof(struct search_node));
+    search_levels[1] = search_map(SEARCH_FRONTIER * sizeof(struct search_node));
+
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = workers > 0 ? workers : 1;
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&search->barrier, &attr, workers);
+
+    node_save(&search_levels[0][0]);
+    search_levels[0][0].depth = 0;
+    search_levels[0][0].path[0] = '\0';
+    search_visit(hash_state(&search_levels[0][0]));
+    search->level_size[0] = 1;
+
+    fflush(stdout);
+    long worker = 0;
+    for (long i = 1; i < workers && worker == 0; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            printf("Could not start search worker\n");
+            exit(1);
+        }
+        worker = pid ? 0 : i;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct search_node scratch;
+    for (int d = 0; d < depth; d++)
+    {
+        search_level(d, &scratch);
+        pthread_barrier_wait(&search->barrier);
+
+        if (worker == 0)
+        {
+            uint32_t *next = &search->level_size[(d + 1) & 1];
+            *next = *next > SEARCH_FRONTIER ? SEARCH_FRONTIER : *next;
+            printf("; depth %d: %u new states, %u code addresses reached\n", d + 1, *next, search->covered_count);
+            fflush(stdout);
+            search->level_size[d & 1] = 0;
+            search->taken = 0;
+        }
+        pthread_barrier_wait(&search->barrier);
+
+        if (!search->level_size[(d + 1) & 1])
+        {
+            break;
+        }
+    }
+
+    if (worker)
+    {
+        exit(0);
     }
+    while (wait(NULL) > 0)
+    {
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("; %llu states stepped, %llu unique, %llu dropped, %u code addresses, %ld workers, %.2fs, %.0f states/s\n",
+           (unsigned long long)search->states, (unsigned long long)search->unique,
+           (unsigned long long)search->dropped, search->covered_count, workers, seconds,
+           seconds > 0 ? search->states / seconds : 0.0);
+    return 0;
 }
 
+/* END STATE SPACE SEARCH */
+
+#ifndef CHIP8_LIB
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    char *romdb_file = "roms/romdb.txt";
+    char *keymap_file = NULL;
+    char *bundle_file = NULL;
+    char *pack_file = NULL;
+    char *serve_addr = NULL;
+    int search_depth = 0;
+    uint32_t frames = 0;
+    int batch = 0;
+    int print_hash = 0;
+    int analyze = 0;
+    int translate = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:k:HACVb:n:p:tm:gT:D:S:s:e:r:")) != -1)
     {
-        printf("Must provide rom as first argument!\n");
-        return 1;
+        switch (opt)
+        {
+        case 'd':
+            romdb_file = optarg;
+            break;
+        case 'k':
+            keymap_file = optarg;
+            break;
+        case 'H':
+            print_hash = 1;
+            break;
+        case 'A':
+            analyze = 1;
+            break;
+        case 'C':
+            translate = 1;
+            break;
+        case 'b':
+            bundle_file = optarg;
+            batch = 1;
+            break;
+        case 'n':
+            frames = strtoul(optarg, NULL, 10);
+            batch = 1;
+            break;
+        case 'p':
+            pack_file = optarg;
+            break;
+        case 't':
+            turbo = 0x1;
+            break;
+        case 'V':
+            forced_quirks |= QUIRK_VIP;
+            break;
+        case 'g':
+            prog_pause = 0x1;
+            break;
+        case 'T':
+            trace_name = optarg;
+            break;
+        case 'r':
+            capture_name = optarg;
+            break;
+        case 's':
+            serve_addr = optarg;
+            break;
+        case 'e':
+            search_depth = atoi(optarg);
+            break;
+        case 'D':
+            return dump_trace(optarg, &argv[optind], argc - optind);
+        case 'S':
+            return summarize_trace(optarg);
+        case 'm':
+            metrics_out = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+            if (!metrics_out)
+            {
+                printf("Could not write metrics to %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            printf("usage: %s [-d romdb] [-k keymap] [-H] [-A] [-C] [-V] [-t] [-g] [-m metrics] [-T trace] [-r recording] romfile\n"
+                   "       %s [-d romdb] [-T trace] -s port|socket romfile\n"
+                   "       %s [-d romdb] -e depth romfile\n"
+                   "       %s [-d romdb] [-V] [-n frames] [-b bundle] [-T trace] [-r recording] [rom...]\n"
+                   "       %s -p bundle romfile...\n"
+                   "       %s -D trace [lo hi] | -S trace\n",
+                   argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
     }
-    // set seed for rand
-    srand((unsigned int)time(0) + getpid());
 
-    // setup memory
-    read_rom(main_mem, argv[1]);
-    load_fontset(main_mem, fontset, FONTSET_SIZE);
+    if (pack_file)
+    {
+        return pack_bundle(pack_file, &argv[optind], argc - optind);
+    }
+
+    // per rom settings
+    if (load_romdb(romdb_file) < 0)
+    {
+        printf("Out of memory reading rom database\n");
+        return 1;
+    }
 
     // setup function pointer tables
     setup_functables();
 
-    // get graphics ready
-    g_init();
+    if (batch && (trace_name || capture_name) && argc - optind != 1)
+    {
+        printf("Can only trace or record one rom at a time\n");
+        return 1;
+    }
 
-    // initialize debugger
+    if (batch)
+    {
+        return run_batch(bundle_file, &argv[optind], argc - optind, frames);
+    }
 
-    initscr();
-    scrollok(stdscr, 1);
-    setscrreg(0, 27);
-    refresh();
+    // setup memory
+    reset_machine();
+
+    int embedded = 0;
+#ifdef CHIP8_AOT
+    // a translated build runs the rom it was translated from when no rom is given
+    if (optind == argc)
+    {
+        load_rom_image(main_mem, aot_rom, aot_rom_size, aot_rom_hash);
+        embedded = 1;
+    }
+#endif
+
+    if (!embedded && optind != argc - 1)
+    {
+        printf("Must provide rom as first argument!\n");
+        return 1;
+    }
+    // seed the random numbers, xorshift never leaves a zero state so keep it odd
+    rng_state = ((uint32_t)time(0) + getpid()) | 0x1u;
+
+    if (!embedded)
+    {
+        read_rom(main_mem, argv[optind]);
+    }
+
+    if (print_hash)
+    {
+        printf("%016llx %s\n", (unsigned long long)rom_hash, embedded ? "(embedded)" : argv[optind]);
+        return 0;
+    }
+
+    apply_romdb();
+
+    if (analyze)
+    {
+        return print_analysis();
+    }
+
+    if (translate)
+    {
+        return print_aot();
+    }
+
+    if (search_depth)
+    {
+        return run_search(search_depth);
+    }
+
+    if (trace_name)
+    {
+        trace_open(trace_name);
+    }
+    if (capture_name)
+    {
+        capture_open(capture_name);
+    }
+    select_core();
+
+    save_pristine();
+
+    if (serve_addr)
+    {
+        int status = run_server(serve_addr);
+        trace_close();
+        capture_close();
+        return status;
+    }
+
+    // get graphics and input ready
+    load_keymap(keymap_file ? keymap_file : rom_keymap);
+    g_init();
 
-    print_state();
+    // the debugger view starts with the first state printed, turbo runs never need it
+    if (!turbo || prog_pause)
+    {
+        print_state();
+    }
 
 
+    metrics_reset();
+
     int quit = 0;
     while (!quit)
     {
+        uint32_t frame_start = SDL_GetTicks();
+        uint64_t loop_start = SDL_GetPerformanceCounter();
+
         quit = g_poll();
+        if (restart)
+        {
+            restart_machine();
+#ifdef CHIP8_AOT
+            aot_reset();
+#endif
+            restart = 0x0;
+        }
+        uint64_t poll_end = SDL_GetPerformanceCounter();
+        metrics.poll += poll_end - loop_start;
+
         if (!prog_pause) {
-            cycle();
+            metrics.instructions += (*frame_core)();
+            metrics.frames++;
+            if (capture_file)
+            {
+                capture_frame();
+            }
+
+            // keep running frames until the display is due for a refresh, every one
+            // of them is recorded so the recording keeps the rom's own timing
+            while (turbo && !prog_pause && SDL_GetTicks() - frame_start < FRAME_MS)
+            {
+                metrics.instructions += (*frame_core)();
+                metrics.frames++;
+                if (capture_file)
+                {
+                    capture_frame();
+                }
+            }
+            uint64_t cycle_end = SDL_GetPerformanceCounter();
+            metrics.cycle += cycle_end - poll_end;
+
             g_draw();
-            SDL_Delay(speed);
+            uint64_t draw_end = SDL_GetPerformanceCounter();
+            metrics.draw += draw_end - cycle_end;
+            metrics_present(draw_end - cycle_end);
+
+            if (!turbo || prog_pause)
+            {
+                print_state();
+            }
+        }
+        else
+        {
+            debug_input();
+        }
+
+        uint32_t elapsed = SDL_GetTicks() - frame_start;
+        if (elapsed < FRAME_MS)
+        {
+            SDL_Delay(FRAME_MS - elapsed);
+        }
+
+        if (!prog_pause)
+        {
+            metrics.run += SDL_GetPerformanceCounter() - loop_start;
         }
+        metrics_report();
     }
 
     g_cleanup();
 
-    endwin();
+    if (terminal)
+    {
+        endwin();
+    }
+
+    trace_close();
+    capture_close();
+
+    if (!embedded)
+    {
+        munmap((void *)rom_image, rom_size);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
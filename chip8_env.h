@@ -0,0 +1,53 @@
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+#include <stdint.h>
+
+/*
+    Environment api for running agents against chip-8 roms, built into
+    libchip8.so by make lib. An environment holds a batch of machines
+    running the same rom that are stepped together a number of frames at
+    a time. Observations are written into buffers the caller allocates
+    once, nothing is allocated while stepping. The emulator state is
+    global so only one environment can exist at a time, it has to be
+    destroyed before the next one is created
+*/
+
+// bytes of display per machine, 32 rows of 64 pixels packed msb first
+#define CHIP8_ENV_SCREEN 256
+
+// bytes of memory per machine
+#define CHIP8_ENV_RAM 0x1000
+
+// the library is built with hidden visibility, only the api is exported
+#define CHIP8_ENV_API __attribute__((visibility("default")))
+
+struct chip8_env;
+
+/*
+    Load a rom into count machines, settings come from the rom database when romdb is not NULL.
+    Returns NULL if the rom cannot be loaded, there is not the memory for the machines or
+    another environment still exists
+*/
+CHIP8_ENV_API struct chip8_env *chip8_env_create(char *rom, char *romdb, uint32_t count);
+
+/*
+    Hold the keys in actions[i] (bit k for key k) on machine i and run every machine
+    frames frames. screens and ram, either may be NULL, get count * CHIP8_ENV_SCREEN
+    and count * CHIP8_ENV_RAM bytes of observations
+*/
+CHIP8_ENV_API void chip8_env_step(struct chip8_env *env, const uint16_t *actions, uint32_t frames,
+                                  uint8_t *screens, uint8_t *ram);
+
+/*
+    Save the state of machine i as the one it is reset to, machines start out saved at power on.
+    The state includes the machine's random number generator so a reset replays exactly
+*/
+CHIP8_ENV_API void chip8_env_save(struct chip8_env *env, uint32_t i);
+
+/* Put machine i back into its saved state */
+CHIP8_ENV_API void chip8_env_reset(struct chip8_env *env, uint32_t i);
+
+CHIP8_ENV_API void chip8_env_destroy(struct chip8_env *env);
+
+#endif
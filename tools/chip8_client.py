@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+Test client for the framebuffer server started with ./chip8 -s.
+
+    tools/chip8_client.py 5555                 draw the display in the terminal
+    tools/chip8_client.py /tmp/chip8.sock      same over a unix socket
+    tools/chip8_client.py 5555 -t 5            run for 5 seconds, then print the
+                                               last display and the bandwidth used
+
+Keys use the emulator's default layout (1234 / qwer / asdf / zxcv). A
+terminal only reports presses, so every press is released again after
+KEY_HOLD seconds.
+"""
+
+import argparse
+import os
+import select
+import socket
+import sys
+import termios
+import time
+import tty
+
+# chip-8 key for each keyboard key, the same layout as DEFAULT_KEYS in chip8.c
+KEYS = {'x': 0x0, '1': 0x1, '2': 0x2, '3': 0x3, 'q': 0x4, 'w': 0x5, 'e': 0x6, 'a': 0x7,
+        's': 0x8, 'd': 0x9, 'z': 0xA, 'c': 0xB, '4': 0xC, 'r': 0xD, 'f': 0xE, 'v': 0xF}
+
+KEY_HOLD = 0.15
+
+
+class Display:
+    """The display as the server last sent it, one 64 bit integer per row"""
+
+    def __init__(self):
+        self.rows = [0] * 32
+        self.frames = 0
+
+    def decode(self, buf):
+        """Apply every whole frame in buf, returns how many bytes were used"""
+        used = 0
+        while len(buf) - used >= 5:
+            if buf[used] != ord('F'):
+                raise ValueError('bad frame byte %02x' % buf[used])
+            mask = int.from_bytes(buf[used + 1:used + 5], 'big')
+            pos = used + 5
+            rows = list(self.rows)
+            for y in range(32):
+                if not mask & (0x80000000 >> y):
+                    continue
+                delta = b''
+                while len(delta) < 8:
+                    if pos >= len(buf):
+                        return used
+                    code = buf[pos]
+                    pos += 1
+                    if code & 0x80:
+                        delta += bytes((code & 0x7F) + 1)
+                    else:
+                        if pos + code + 1 > len(buf):
+                            return used
+                        delta += buf[pos:pos + code + 1]
+                        pos += code + 1
+                rows[y] ^= int.from_bytes(delta, 'big')
+            self.rows = rows
+            self.frames += 1
+            used = pos
+        return used
+
+    def text(self):
+        return '\n'.join(''.join('#' if row >> (63 - x) & 1 else '.' for x in range(64)) for row in self.rows)
+
+
+def connect(addr):
+    if addr.isdigit():
+        return socket.create_connection(('127.0.0.1', int(addr)))
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(addr)
+    return sock
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Test client for ./chip8 -s')
+    parser.add_argument('addr', help='tcp port on localhost or unix socket path')
+    parser.add_argument('-t', type=float, metavar='SECONDS',
+                        help='run without drawing for this long, then print the display')
+    args = parser.parse_args()
+
+    sock = connect(args.addr)
+    display = Display()
+    pending = b''
+    received = 0
+    released = {}
+    interactive = args.t is None and sys.stdin.isatty()
+    saved = termios.tcgetattr(sys.stdin) if interactive else None
+    start = time.time()
+
+    try:
+        if interactive:
+            tty.setcbreak(sys.stdin)
+            sys.stdout.write('\x1b[2J')
+        while args.t is None or time.time() - start < args.t:
+            watch = [sock, sys.stdin] if interactive else [sock]
+            ready, _, _ = select.select(watch, [], [], 0.01)
+            if sock in ready:
+                data = sock.recv(4096)
+                if not data:
+                    break
+                received += len(data)
+                pending += data
+                pending = pending[display.decode(pending):]
+                if interactive:
+                    sys.stdout.write('\x1b[H' + display.text() + '\n')
+                    sys.stdout.flush()
+            if sys.stdin in ready:
+                ch = os.read(sys.stdin.fileno(), 1).decode(errors='ignore').lower()
+                if ch in KEYS:
+                    sock.send(bytes([0x80 | KEYS[ch]]))
+                    released[KEYS[ch]] = time.time() + KEY_HOLD
+            now = time.time()
+            for key, when in list(released.items()):
+                if now >= when:
+                    sock.send(bytes([key]))
+                    del released[key]
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if saved:
+            termios.tcsetattr(sys.stdin, termios.TCSADRAIN, saved)
+        sock.close()
+
+    elapsed = time.time() - start
+    if not interactive:
+        print(display.text())
+    print('%d frames, %.0f bytes/s' % (display.frames, received / elapsed if elapsed else 0))
+
+
+if __name__ == '__main__':
+    main()